@@ -9,6 +9,7 @@
  */
 #define AVR_I2C_DDR         DDRD
 #define AVR_I2C_PORT        PORTD
+#define AVR_I2C_PIN         PIND
 #define AVR_I2C_PORT_SCL    PD0
 #define AVR_I2C_PORT_SDA    PD1
 
@@ -20,6 +20,7 @@
  */
 #define AVR_I2C_DDR         DDRC
 #define AVR_I2C_PORT        PORTC
+#define AVR_I2C_PIN         PINC
 #define AVR_I2C_PORT_SCL    PC5
 #define AVR_I2C_PORT_SDA    PC4
 
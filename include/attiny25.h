@@ -9,6 +9,7 @@
  */
 #define AVR_I2C_DDR         DDRB
 #define AVR_I2C_PORT        PORTB
+#define AVR_I2C_PIN         PINB
 #define AVR_I2C_PORT_SCL    PB2
 #define AVR_I2C_PORT_SDA    PB0
 
@@ -3,6 +3,51 @@
 
 #include <stdint.h>
 
+#define CLOCK_TICKS_PER_SEC     100
+
+/*
+ * Compare and subtract times (in ticks, microseconds or cycles) so that
+ * they still work when the counter wraps around, as long as the times are
+ * within 2^31 of each other
+ */
+#define clock_time_before(A, B)     ((int32_t)((uint32_t)(A) - (uint32_t)(B)) < 0)
+#define clock_time_after(A, B)      clock_time_before(B, A)
+#define clock_elapsed(SINCE)        (clock_current_time() - (uint32_t)(SINCE))
+#define clock_elapsed_us(SINCE)     (clock_now_us() - (uint32_t)(SINCE))
+
+#ifndef UNIX_EPOCH_OFFSET
+#define UNIX_EPOCH_OFFSET       2208988800UL    /* NTP (1900) to Unix (1970) */
+#endif
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+/*
+ * Offsets bigger than this are treated as a new time rather than drift
+ */
+#define CLOCK_MAX_DRIFT_SECS     1000
+
+/*
+ * The largest correction clock_slew() will make, in 16.16 fixed point
+ * seconds
+ */
+#define CLOCK_MAX_SLEW          (2L << 16)
+
+/*
+ * Wall clock synchronisation statistics.  Offsets are the reference time
+ * minus our time at each sync, in 10ms ticks.
+ */
+typedef struct
+{
+    uint8_t     valid;          /* the wall clock has been set */
+    uint16_t    syncs;
+    int32_t     last_offset;
+    int32_t     max_offset;     /* largest magnitude seen */
+    int32_t     drift_ppm;      /* estimated from the last two syncs */
+    uint32_t    set_secs;       /* the time it was last set (or synced) to */
+    uint8_t     set_ticks;
+}
+    clock_wall_stats_t;
+#endif
+
 extern void
 clock_init(void);
 
@@ -12,4 +57,38 @@ clock_increment(void);
 extern uint32_t
 clock_current_time(void);
 
+extern uint32_t
+clock_now_us(void);
+
+extern uint32_t
+clock_now_cycles(void);
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+extern void
+clock_set_wakeup(uint32_t tick);
+#endif
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+extern uint32_t
+clock_wall_time(uint8_t *ticks);
+
+extern void
+clock_set_wall_time(uint32_t secs, uint8_t ticks);
+
+extern void
+clock_sync_wall_time(uint32_t secs, uint8_t ticks);
+
+extern void
+clock_get_wall_stats(clock_wall_stats_t *stats);
+
+extern uint8_t
+clock_wall_time_valid(void);
+
+extern void
+clock_get_ntp_time(uint32_t *secs, uint32_t *frac);
+
+extern void
+clock_slew(int32_t offset);
+#endif
+
 #endif /* __INCLUDE_CLOCK_H */
@@ -0,0 +1,25 @@
+#ifndef __INCLUDE_CRC8_H
+#define __INCLUDE_CRC8_H
+
+#include <stdint.h>
+
+/*
+ * Dallas/Maxim 1-Wire CRC8 (x^8 + x^5 + x^4 + 1).
+ *
+ * The implementation is chosen at compile time with AVR_FEATURE_CRC8_TABLE:
+ *   0   - bit-serial, no table
+ *   16  - 16-entry nibble table (the default)
+ *   256 - 256-entry byte table
+ * Tables are kept in program memory.
+ */
+
+extern uint8_t
+crc8_update(uint8_t crc, uint8_t data);
+
+extern uint8_t
+crc8(const uint8_t *data, uint8_t len);
+
+extern uint8_t
+crc8_rom(uint64_t rom);
+
+#endif /* __INCLUDE_CRC8_H */
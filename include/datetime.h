@@ -0,0 +1,59 @@
+#ifndef __INCLUDE_DATETIME_H
+#define __INCLUDE_DATETIME_H
+
+#include <stdint.h>
+
+/*
+ * Seconds from the NTP epoch (1900) to the Unix epoch (1970)
+ */
+#ifndef UNIX_EPOCH_OFFSET
+#define UNIX_EPOCH_OFFSET   2208988800UL
+#endif
+#define SECONDS_PER_DAY     86400UL
+
+/*
+ * Length of the formatted strings, including the terminating NUL
+ */
+#define DATETIME_HTTP_LEN   30      /* "Sun, 06 Nov 1994 08:49:37 GMT" */
+#define DATETIME_ISO_LEN    21      /* "1994-11-06T08:49:37Z" */
+
+/*
+ * A broken-down UTC time
+ */
+typedef struct
+{
+    uint16_t    year;
+    uint8_t     month;      /* 1-12 */
+    uint8_t     day;        /* 1-31 */
+    uint8_t     hour;
+    uint8_t     min;
+    uint8_t     sec;
+    uint8_t     wday;       /* 0-6, Sunday is 0 */
+}
+    datetime_t;
+
+#define datetime_bcd_pack(X)    ((uint8_t)((((X) / 10) << 4) | ((X) % 10)))
+#define datetime_bcd_unpack(X)  ((uint8_t)((((X) >> 4) * 10) + ((X) & 0x0f)))
+
+extern void
+datetime_civil_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day);
+
+extern uint32_t
+datetime_days_from_civil(uint16_t year, uint8_t month, uint8_t day);
+
+extern uint8_t
+datetime_weekday(uint32_t days);
+
+extern void
+datetime_from_unix(uint32_t t, datetime_t *dt);
+
+extern uint32_t
+datetime_to_unix(const datetime_t *dt);
+
+extern void
+datetime_format_http(const datetime_t *dt, char *buf);
+
+extern void
+datetime_format_iso(const datetime_t *dt, char *buf);
+
+#endif /* __INCLUDE_DATETIME_H */
@@ -3,14 +3,79 @@
 
 #define OW_CMD_CONVERT_T        0x44
 #define OW_CMD_READ_SCRATCHPAD  0xbe
+#define OW_CMD_WRITE_SCRATCHPAD 0x4e
+
+/*
+ * Temperatures are returned as fixed-point values in 1/16ths of a degree C
+ */
+#define DS1820_FRAC_BITS        4
+
+/*
+ * 1-Wire family codes of supported temperature sensors
+ */
+#define DS1820_FAMILY_DS18S20   0x10
+#define DS1820_FAMILY_DS1822    0x22
+#define DS1820_FAMILY_DS18B20   0x28
+
+/*
+ * Called when an asynchronous conversion has been read back.  sensor is the
+ * index of the sensor from ds1820_scan_sensors(), or 0 for a single sensor;
+ * t is in 1/16ths of a degree C.
+ */
+typedef void    (ds1820_temperature_callback_t)(uint8_t sensor, int16_t t);
 
 extern void
 ds1820_cmd_convert_t(void);
 
 extern void
+ds1820_start_convert_t(void);
+
+extern uint8_t
+ds1820_conversion_done(void);
+
+extern uint8_t
 ds1820_cmd_read_scratchpad(uint8_t *x);
 
-extern void
+extern uint8_t
 ds1820_get_temperature(uint8_t *degrees, uint8_t *half);
 
+extern uint8_t
+ds1820_get_temperature_fixed(int16_t *t);
+
+extern uint8_t
+ds18b20_set_resolution(uint8_t bits);
+
+extern uint8_t
+ds18b20_get_resolution(void);
+
+#if AVR_FEATURE_TASKS
+extern uint8_t
+ds1820_start_temperature(ds1820_temperature_callback_t *callback);
+#endif
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+extern uint8_t
+ds1820_scan_sensors(void);
+
+extern uint8_t
+ds1820_sensor_count(void);
+
+extern uint64_t
+ds1820_sensor_rom(uint8_t sensor);
+
+extern void
+ds1820_convert_all(void);
+
+extern uint8_t
+ds1820_read_sensor(uint8_t sensor, uint8_t *degrees, uint8_t *half);
+
+extern uint8_t
+ds1820_read_sensor_fixed(uint8_t sensor, int16_t *t);
+
+#if AVR_FEATURE_DS1820_PERSIST_ROMS
+extern uint8_t
+ds1820_load_sensors(void);
+#endif
+#endif
+
 #endif /* __INCLUDE_DS1820_H */
@@ -0,0 +1,83 @@
+#ifndef __INCLUDE_HISTORY_H
+#define __INCLUDE_HISTORY_H
+
+#include <stdint.h>
+
+#include "avr-common.h"
+
+/*
+ * Number of values in each sample (at most 7)
+ */
+#ifdef AVR_FEATURE_HISTORY_CHANNELS
+# define HISTORY_CHANNELS   AVR_FEATURE_HISTORY_CHANNELS
+#else
+# define HISTORY_CHANNELS   2
+#endif
+
+/*
+ * The longest encoded sample, in bytes
+ */
+#define HISTORY_MAX_RECORD  (1 + 5 * (1 + HISTORY_CHANNELS))
+
+typedef struct
+{
+    uint32_t    time;
+    int32_t     value[HISTORY_CHANNELS];
+}
+    history_sample_t;
+
+/*
+ * A time series, packed into a caller-supplied byte ring.  The oldest sample
+ * is kept unpacked, and every later sample is stored as the difference from
+ * the one before it.
+ */
+typedef struct history history_t;
+struct history
+{
+    uint8_t             *buf;
+    uint16_t            size;
+    uint16_t            head;           /* next byte to write */
+    uint16_t            used;           /* bytes in the ring */
+    uint16_t            count;          /* samples, including the oldest */
+
+    history_sample_t    first;          /* the oldest sample */
+    int32_t             first_tdelta;   /* time step up to the oldest sample */
+    history_sample_t    last;           /* the newest sample */
+    int32_t             last_tdelta;    /* time step up to the newest sample */
+
+    history_t           *coarse;        /* where evicted samples are averaged to */
+    uint8_t             ratio;          /* samples per coarse sample */
+    uint8_t             acc_n;
+    uint32_t            acc_time;
+    int32_t             acc[HISTORY_CHANNELS];
+};
+
+/*
+ * State for reading a history from oldest to newest
+ */
+typedef struct
+{
+    const history_t     *h;
+    uint16_t            pos;
+    uint16_t            left;           /* samples still to read */
+    history_sample_t    cur;
+    int32_t             tdelta;
+}
+    history_iter_t;
+
+extern void
+history_init(history_t *h, uint8_t *buf, uint16_t size, history_t *coarse, uint8_t ratio);
+
+extern void
+history_append(history_t *h, uint32_t time, const int32_t *values);
+
+extern uint16_t
+history_count(const history_t *h);
+
+extern void
+history_iter_init(history_iter_t *it, const history_t *h);
+
+extern uint8_t
+history_iter_next(history_iter_t *it, history_sample_t *sample);
+
+#endif /* __INCLUDE_HISTORY_H */
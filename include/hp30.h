@@ -10,11 +10,27 @@ typedef struct
 }
     hp30_measure_t;
 
+/*
+ * Called when an asynchronous measurement has finished.  values is only
+ * valid if status is 0.
+ */
+typedef void    (hp30_callback_t)(uint8_t status, const hp30_measure_t *values);
+
 extern void
 hp30_init(uint8_t volatile *port, uint8_t volatile *ddr, uint8_t pin);
 
 extern void
 hp30_read_values(hp30_measure_t *values);
 
+#if AVR_FEATURE_TASKS
+extern uint8_t
+hp30_start_measurement(hp30_callback_t *callback);
+#endif
+
+#if AVR_FEATURE_HP30_BENCHMARK
+extern uint32_t
+hp30_benchmark_compensate(void);
+#endif
+
 #endif /* __INCLUDE_HP30_H */
 
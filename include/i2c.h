@@ -7,12 +7,55 @@
 #define I2C_SLA_W           0x0
 #define I2C_SLA_R           0x1
 
+/*
+ * Errors returned by the master functions when the bus hangs: the bus has
+ * been recovered, or SDA is still held low after recovery
+ */
+#define I2C_ERR_TIMEOUT     3
+#define I2C_ERR_BUS_STUCK   4
+
+/*
+ * Bus speed profiles, selected per device by i2c_start()
+ */
+#define I2C_SPEED_STANDARD  0   /* AVR_I2C_CLOCK_HZ (100kHz) */
+#define I2C_SPEED_FAST      1   /* AVR_I2C_FAST_CLOCK_HZ (400kHz) */
+
+/*
+ * Bus error counters
+ */
+typedef struct
+{
+    uint16_t    timeouts;       // TWI operations that didn't complete
+    uint16_t    recoveries;     // bus recovery sequences sent
+    uint16_t    failed_recoveries;  // SDA still held low afterwards
+    uint16_t    errors;         // unexpected status (e.g. NACK)
+}
+    i2c_stats_t;
+
+/*
+ * Slave mode register map callbacks. These are called from interrupt
+ * context, from within i2c_slave_intr_handler().
+ */
+typedef void    (i2c_slave_write_handler_t)(uint8_t reg, uint8_t value);
+typedef void    (i2c_slave_read_handler_t)(uint8_t reg);
+
 extern void
 i2c_init(void);
 
 extern void
 i2c_slave_init(uint8_t address);
 
+extern void
+i2c_slave_set_register_map(volatile uint8_t *regs, uint8_t size,
+    uint8_t writable, i2c_slave_write_handler_t *write_fn,
+    i2c_slave_read_handler_t *read_fn);
+
+extern void
+i2c_slave_intr_handler(void);
+
+extern uint8_t
+i2c_set_device_speed(uint8_t address, uint8_t speed);
+
 extern uint8_t
 i2c_start(uint8_t address, uint8_t mode) ;
 
@@ -40,4 +83,10 @@ i2c_read_byte_nack(void);
 extern void
 i2c_stop(void);
 
+extern uint8_t
+i2c_bus_failed(void);
+
+extern void
+i2c_get_stats(i2c_stats_t *stats);
+
 #endif /* __INCLUDE_I2C_H */
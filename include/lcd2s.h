@@ -97,4 +97,9 @@ lcd_underline_cursor(uint8_t enable);
 uint8_t
 lcd_load_character(uint8_t id, const uint8_t *data);
 
+#if AVR_FEATURE_LCD2S_BENCHMARK
+extern uint8_t
+lcd_benchmark_refresh(uint32_t *standard_us, uint32_t *fast_us);
+#endif
+
 #endif /* __INCLUDE_LCD2S_H */
@@ -31,6 +31,24 @@
 
 typedef void    ntp_reply_handler_t(uint32_t ntp_time);
 
+/*
+ * An NTP measurement.  offset and delay are in seconds, as 16.16 fixed
+ * point; time is the clock tick the reply was received.  The offset is
+ * only meaningful with AVR_FEATURE_CLOCK_WALL_TIME.  The server's stratum,
+ * root delay and root dispersion are as it reported them.
+ */
+typedef struct
+{
+    int32_t     offset;
+    int32_t     delay;
+    uint8_t     stratum;
+    uint32_t    time;
+    uint8_t     server[4];
+    uint32_t    root_delay;
+    uint32_t    root_disp;
+}
+    ntp_sample_t;
+
 typedef void    http_request_handler_t(uint8_t *data, uint16_t *reply_len);
 
 extern void
@@ -39,7 +57,7 @@ network_set_http_request_handler(http_request_handler_t *f);
 extern void
 network_set_ntp_reply_handler(ntp_reply_handler_t *f);
 
-extern void
+extern uint16_t
 network_read_packet(void);
 
 extern void
@@ -63,4 +81,7 @@ network_init(gpio_line_t *slave_select);
 extern uint8_t
 network_send_ntp_request(uint8_t *server_ip);
 
+extern void
+network_get_ntp_sample(ntp_sample_t *sample);
+
 #endif /* __INCLUDE_NETWORK_H */
@@ -6,9 +6,14 @@
 #define OW_CMD_MATCH_ROM        0x55
 #define OW_CMD_SEARCH_ROM       0xf0
 
+#if AVR_FEATURE_ONEWIRE_UART
+extern void
+onewire_init(void);
+#else
 extern void
 onewire_init(volatile uint8_t *ddr, volatile uint8_t *out,
     volatile uint8_t *in, uint8_t line);
+#endif
 
 extern void
 onewire_reset(uint8_t *x);
@@ -28,6 +33,54 @@ onewire_recv_byte(void);
 extern void
 onewire_wait_until_done(void);
 
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+/*
+ * Asynchronous (Timer2 driven) transactions
+ */
+#define OW_ASYNC_RESET          0x01    /* reset the bus before the transfer */
+
+#define OW_ASYNC_OK             0
+#define OW_ASYNC_NO_PRESENCE    1
+
+typedef void    (onewire_async_callback_t)(uint8_t status);
+
+extern uint8_t
+onewire_async_start(uint8_t flags, const uint8_t *tx, uint8_t ntx,
+    uint8_t *rx, uint8_t nrx, onewire_async_callback_t *callback);
+
+extern uint8_t
+onewire_async_busy(void);
+
+extern uint8_t
+onewire_async_status(void);
+
+extern void
+onewire_timer_intr_handler(void);
+#endif
+
+#if AVR_FEATURE_ONEWIRE_UART
+/*
+ * Non-blocking access to the USART-driven bus
+ */
+extern void
+onewire_uart_start_reset(void);
+
+extern void
+onewire_uart_start_bits(uint8_t x, uint8_t nbits);
+
+extern uint8_t
+onewire_uart_busy(void);
+
+extern uint8_t
+onewire_uart_result(void);
+
+extern uint8_t
+onewire_uart_presence(void);
+
+extern void
+onewire_uart_intr_handler(void);
+#endif
+
 #if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM
 extern void
 onewire_scan_init(void);
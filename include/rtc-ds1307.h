@@ -3,6 +3,8 @@
 
 #include <stdint.h>
 
+#include "datetime.h"
+
 /*
  * Standard I2C address for DS1307 Real Time Clock
  */
@@ -14,7 +16,15 @@ rtc_set_time_from_ntp(uint32_t ntp_time);
 extern uint8_t
 rtc_get_time(uint8_t *sec, uint8_t *min, uint8_t *hr, uint8_t *day, uint8_t *month, uint8_t *year, uint8_t *dow);
 
+extern uint8_t
+rtc_get_datetime(datetime_t *dt);
+
 extern uint8_t
 rtc_init(void);
 
+#if AVR_FEATURE_CLOCK_WALL_TIME && AVR_FEATURE_TASKS
+extern uint8_t
+rtc_start_clock_sync(uint32_t period);
+#endif
+
 #endif /* __INCLUDE_RTC_DS1307_H */
@@ -0,0 +1,47 @@
+#ifndef __INCLUDE_RUNLOOP_H
+#define __INCLUDE_RUNLOOP_H
+
+#include <stdint.h>
+
+/*
+ * Wake sources.  The application's interrupt handlers pass these to
+ * runloop_wake(); the bits from RUNLOOP_WAKE_USER up are free for its own
+ * use.
+ */
+#define RUNLOOP_WAKE_TIMER      0x01    /* a task or timer became due */
+#define RUNLOOP_WAKE_NET        0x02    /* ENC28J60 INT (INT0) */
+#define RUNLOOP_WAKE_UART       0x04    /* UART receive */
+#define RUNLOOP_WAKE_TWI        0x08    /* I2C slave */
+#define RUNLOOP_WAKE_USER       0x10
+
+/*
+ * Run loop statistics.  Latencies are from the first runloop_wake() to
+ * the run loop picking up the event, in microseconds.
+ */
+typedef struct
+{
+    uint32_t    sleeps;
+    uint32_t    wakeups;        /* returns from runloop_poll() */
+    uint32_t    idle_wakeups;   /* interrupts that left nothing to do */
+    uint8_t     last_sources;
+    uint16_t    last_latency_us;
+    uint16_t    max_latency_us;
+}
+    runloop_stats_t;
+
+extern void
+runloop_init(void);
+
+extern void
+runloop_wake(uint8_t source);
+
+extern uint8_t
+runloop_poll(void);
+
+extern void
+runloop_get_stats(runloop_stats_t *stats);
+
+extern void
+runloop_clear_stats(void);
+
+#endif /* __INCLUDE_RUNLOOP_H */
@@ -0,0 +1,74 @@
+#ifndef __INCLUDE_SAMPLER_H
+#define __INCLUDE_SAMPLER_H
+
+#include <stdint.h>
+
+#define SAMPLER_NO_SENSOR   0xff
+
+/*
+ * Identifies one conversion: the sensor number in the low byte, and a
+ * sequence number that changes with each conversion in the high byte
+ */
+typedef uint16_t    sampler_tag_t;
+
+#define sampler_tag_sensor(TAG)     ((uint8_t)(TAG))
+
+/*
+ * Start a conversion on a sensor, without waiting for it.  Returns non-zero
+ * if the conversion couldn't be started.  The tag is passed on to
+ * sampler_record() and sampler_complete() when the conversion finishes.
+ */
+typedef uint8_t (sampler_start_t)(sampler_tag_t tag);
+
+/*
+ * A timestamped result
+ */
+typedef struct
+{
+    uint32_t    time;           /* clock tick the result arrived */
+    uint8_t     sensor;
+    uint8_t     channel;
+    int32_t     value;
+}
+    sampler_sample_t;
+
+/*
+ * Per-sensor timing statistics, in 10ms clock ticks
+ */
+typedef struct
+{
+    uint16_t    started;        /* conversions started */
+    uint16_t    completed;      /* conversions completed successfully */
+    uint16_t    missed;         /* periods skipped: still busy, or failed to start */
+    uint16_t    failed;         /* conversions completed with an error, or abandoned */
+    uint16_t    max_jitter;     /* latest start, relative to the schedule */
+    uint16_t    max_latency;    /* longest time from start to completion */
+    uint16_t    last_latency;
+}
+    sampler_stats_t;
+
+extern uint8_t
+sampler_add_sensor(uint16_t period, sampler_start_t *start);
+
+extern uint8_t
+sampler_start(void);
+
+extern void
+sampler_record(sampler_tag_t tag, uint8_t channel, int32_t value);
+
+extern void
+sampler_complete(sampler_tag_t tag, uint8_t status);
+
+extern uint8_t
+sampler_read(sampler_sample_t *sample);
+
+extern uint16_t
+sampler_overruns(void);
+
+extern uint32_t
+sampler_age(uint8_t sensor);
+
+extern void
+sampler_get_stats(uint8_t sensor, sampler_stats_t *stats);
+
+#endif /* __INCLUDE_SAMPLER_H */
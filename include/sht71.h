@@ -10,6 +10,20 @@ typedef struct
 }
     sht71_measure_t;
 
+/*
+ * Status codes
+ */
+#define SHT71_OK                0
+#define SHT71_ERR_NOACK         1
+#define SHT71_ERR_TIMEOUT       2
+#define SHT71_ERR_CRC           3
+
+/*
+ * Called when an asynchronous measurement has finished.  values is only
+ * valid if status is SHT71_OK.
+ */
+typedef void    (sht71_callback_t)(uint8_t status, const sht71_measure_t *values);
+
 extern void
 sht71_init(gpio_line_t *sck_line, gpio_line_t *data_line);
 
@@ -22,7 +36,18 @@ sht71_write_status(uint8_t v);
 extern void
 sht71_soft_reset(void);
 
-extern void
+extern uint8_t
 sht71_read_values(sht71_measure_t *values);
 
+#if AVR_FEATURE_TASKS
+extern void
+sht71_set_ready_interrupt(volatile uint8_t *pcmsk, uint8_t bit);
+
+extern void
+sht71_intr_handler(void);
+
+extern uint8_t
+sht71_start_measurement(sht71_callback_t *callback);
+#endif
+
 #endif /* __INCLUDE_SHT71_H */
@@ -5,13 +5,26 @@
 
 typedef uint32_t    (task_callback_t)(uint32_t now, uint32_t *data);
 
+typedef uint16_t    task_handle_t;
+
+#define TASK_INVALID        0xffff
+
 extern void
 task_init(void);
 
-extern void
+extern task_handle_t
 task_submit(uint32_t next_run, uint16_t retries, task_callback_t *callback, uint32_t data);
 
+extern uint8_t
+task_cancel(task_handle_t handle);
+
+extern uint8_t
+task_wake(task_handle_t handle);
+
 extern void
 task_run_ready(uint32_t now);
 
+extern uint8_t
+task_next_deadline(uint32_t *deadline);
+
 #endif /* __INCLUDE_TASK_H */
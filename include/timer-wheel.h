@@ -0,0 +1,37 @@
+#ifndef __INCLUDE_TIMER_WHEEL_H
+#define __INCLUDE_TIMER_WHEEL_H
+
+#include <stdint.h>
+
+typedef void    (timer_wheel_callback_t)(uint32_t now, uint32_t data);
+
+/*
+ * A timer.  The caller provides the storage, which must start zeroed (as
+ * static variables are), and must not touch the fields.
+ */
+typedef struct timer_wheel_entry    timer_wheel_entry_t;
+struct timer_wheel_entry
+{
+    timer_wheel_entry_t     *next;
+    timer_wheel_entry_t     **pprev;    /* 0 if not pending */
+    uint32_t                expires;
+    timer_wheel_callback_t  *callback;
+    uint32_t                data;
+};
+
+extern void
+timer_wheel_start(timer_wheel_entry_t *t, uint32_t expires, timer_wheel_callback_t *callback, uint32_t data);
+
+extern void
+timer_wheel_cancel(timer_wheel_entry_t *t);
+
+extern uint8_t
+timer_wheel_pending(const timer_wheel_entry_t *t);
+
+extern void
+timer_wheel_run(uint32_t now);
+
+extern uint8_t
+timer_wheel_next_deadline(uint32_t *deadline);
+
+#endif /* __INCLUDE_TIMER_WHEEL_H */
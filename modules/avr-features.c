@@ -24,6 +24,10 @@
 #include "rtc-ds1307.c"
 #endif
 
+#if AVR_FEATURE_DATETIME || AVR_FEATURE_DS1307
+#include "datetime.c"
+#endif
+
 #if AVR_FEATURE_LCD2S
 #include "lcd2s.c"
 #endif
@@ -36,6 +40,14 @@
 #include "one-wire.c"
 #endif
 
+#if AVR_FEATURE_ONEWIRE_UART
+#include "one-wire-uart.c"
+#endif
+
+#if AVR_FEATURE_CRC8 || AVR_FEATURE_DS1820 || AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM
+#include "crc8.c"
+#endif
+
 #if AVR_FEATURE_NWSTACK
 #include "nw-stack.c"
 #endif
@@ -52,6 +64,22 @@
 #include "task.c"
 #endif
 
+#if AVR_FEATURE_TIMER_WHEEL || AVR_FEATURE_NWSTACK
+#include "timer-wheel.c"
+#endif
+
+#if AVR_FEATURE_SAMPLER
+#include "sampler.c"
+#endif
+
+#if AVR_FEATURE_RUNLOOP
+#include "runloop.c"
+#endif
+
+#if AVR_FEATURE_HISTORY
+#include "history.c"
+#endif
+
 void
 avr_features_init(void)
 {
@@ -74,4 +102,8 @@ avr_features_init(void)
 #if AVR_FEATURE_TASK
     task_init();
 #endif
+
+#if AVR_FEATURE_RUNLOOP
+    runloop_init();
+#endif
 }
@@ -1,25 +1,276 @@
 /*
  * Implement a 10ms clock counter
+ *
+ * Normally Timer1 runs in CTC mode and interrupts every tick.  With
+ * AVR_FEATURE_CLOCK_TICKLESS it runs freely instead, and the tick count is
+ * worked out from TCNT1 whenever it is needed.  The compare interrupt is
+ * then only used to wake up for the next deadline set by
+ * clock_set_wakeup(), or often enough to keep track of the counter
+ * wrapping: an idle node gets about one interrupt a second, not 100.
  */
 #include <avr/io.h>
+#include <util/atomic.h>
 
 #include "avr-common.h"
 #include "clock.h"
 
+/*
+ * Timer1 counts per second and per 10ms tick
+ */
+#if AVR_FEATURE_CLOCK_TICKLESS
+#define CLOCK_PRESCALE          256L
+#else
+#define CLOCK_PRESCALE          8L
+#endif
+
+#define CLOCK_COUNTS_PER_SEC    (F_CPU / CLOCK_PRESCALE)
+#define CLOCK_COUNTS_PER_TICK   (CLOCK_COUNTS_PER_SEC / CLOCK_TICKS_PER_SEC)
+
+/*
+ * Slewing the wall clock: while slew_counts is non-zero, each tick is
+ * shortened (or lengthened) by up to SLEW_STEP timer counts, i.e. 500ppm
+ * (or one count, if that is more), until the correction has been made up.
+ */
+#define SLEW_STEP   ((int16_t)(CLOCK_COUNTS_PER_TICK / 2000 ? CLOCK_COUNTS_PER_TICK / 2000 : 1))
+
 /*
  * 32-bit clock, with 10ms ticks
  */
 static volatile uint32_t    tick_10ms;
 
+#if AVR_FEATURE_CLOCK_TICKLESS
+/*
+ * TCNT1 at the start of the current tick.  The counts per second don't
+ * divide exactly into ticks, so the leftover counts are spread over the
+ * ticks of each second (tick_frac accumulates them).
+ */
+static uint16_t             tick_base;
+static uint8_t              tick_frac;
+
+#define TICK_FRAC           (CLOCK_COUNTS_PER_SEC % CLOCK_TICKS_PER_SEC)
+
+/*
+ * The longest time between interrupts: TCNT1 must not get a whole counter
+ * period ahead of tick_base
+ */
+#define MAX_SLEEP_COUNTS    0xc000
+#define MIN_SLEEP_COUNTS    2
+
+static volatile uint32_t    wake_tick;
+static volatile uint8_t     wake_set;
+#endif
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+/*
+ * Wall clock: Unix time in seconds, plus the 10ms ticks into the second.
+ * It is set (and periodically corrected) from an RTC or NTP, and runs
+ * from the 10ms tick in between.
+ */
+static volatile uint32_t    wall_secs;
+static volatile uint8_t     wall_ticks;
+
+static clock_wall_stats_t   wall_stats;
+static uint32_t             last_sync;      // tick_10ms at the last sync
+
+static volatile int32_t     slew_counts;
+static volatile uint8_t     slewing;
+
+static inline void
+clock_wall_tick(void)
+{
+    if (++wall_ticks == CLOCK_TICKS_PER_SEC)
+    {
+        wall_ticks = 0;
+        wall_secs++;
+    }
+}
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+static inline void
+clock_wall_advance(uint16_t n)
+{
+    uint16_t    t   = wall_ticks + n;
+
+    wall_secs += t / CLOCK_TICKS_PER_SEC;
+    wall_ticks = t % CLOCK_TICKS_PER_SEC;
+}
+#endif
+
+/*
+ * How much shorter than usual the next tick should be
+ */
+static inline int16_t
+clock_slew_step(void)
+{
+    if (slew_counts > SLEW_STEP)
+        return SLEW_STEP;
+
+    if (slew_counts < -SLEW_STEP)
+        return -SLEW_STEP;
+
+    return slew_counts;
+}
+#endif
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+/*
+ * Count the ticks that have passed since tick_base.  Called with
+ * interrupts disabled, from the compare interrupt and every read of the
+ * clock, so after a long sleep the ticks are counted in batches rather
+ * than one at a time: each batch is as many ticks as must have passed
+ * even if they were all the longest they could be, with the same slew
+ * step throughout.  Only the last tick or two are left to count singly.
+ */
+static void
+clock_catch_up(void)
+{
+    uint16_t    elapsed = TCNT1 - tick_base;
+
+    for (;;)
+    {
+        uint16_t    len     = CLOCK_COUNTS_PER_TICK;
+        uint16_t    n;
+        uint8_t     frac;
+        int16_t     step    = 0;
+#if AVR_FEATURE_CLOCK_WALL_TIME
+        step = clock_slew_step();
+#endif
+
+        n = elapsed / (uint16_t)(CLOCK_COUNTS_PER_TICK + 1 - step);
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+        // the slew step changes when the correction is nearly made up
+        if (step != 0 && n > slew_counts / step)
+            n = slew_counts / step;
+#endif
+
+        if (n > 1)
+        {
+            uint32_t    fracs   = tick_frac + (uint32_t)n * TICK_FRAC;
+            uint16_t    counts  = n * (uint16_t)(CLOCK_COUNTS_PER_TICK - step) + fracs / CLOCK_TICKS_PER_SEC;
+
+            elapsed -= counts;
+            tick_base += counts;
+            tick_frac = fracs % CLOCK_TICKS_PER_SEC;
+            tick_10ms += n;
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+            slew_counts -= (int32_t)n * step;
+            clock_wall_advance(n);
+#endif
+            continue;
+        }
+
+        frac = tick_frac + TICK_FRAC;
+        len -= step;
+
+        if (frac >= CLOCK_TICKS_PER_SEC)
+        {
+            frac -= CLOCK_TICKS_PER_SEC;
+            len++;
+        }
+
+        if (elapsed < len)
+            break;
+
+        elapsed -= len;
+        tick_base += len;
+        tick_frac = frac;
+        tick_10ms++;
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+        slew_counts -= step;
+        clock_wall_tick();
+#endif
+    }
+}
+
+/*
+ * Set the compare interrupt for the wakeup tick, if there is one soon
+ * enough, or else as late as we can.  Called with interrupts disabled.
+ */
+static void
+clock_program_compare(void)
+{
+    uint16_t    now     = TCNT1;
+    uint16_t    delta   = MAX_SLEEP_COUNTS;
+
+    if (wake_set)
+    {
+        int32_t     ticks   = (int32_t)(wake_tick - tick_10ms);
+
+        if (ticks <= 0)
+        {
+            wake_set = 0;
+        }
+        else
+        if (ticks < (int32_t)(MAX_SLEEP_COUNTS / (CLOCK_COUNTS_PER_TICK + 1 + SLEW_STEP)))
+        {
+            // allow for the longest the ticks could be, so as not to be early
+            uint16_t    counts  = ticks * (CLOCK_COUNTS_PER_TICK + 1 + SLEW_STEP);
+            uint16_t    elapsed = now - tick_base;
+
+            delta = counts > elapsed + MIN_SLEEP_COUNTS ? counts - elapsed : MIN_SLEEP_COUNTS;
+        }
+    }
+
+    OCR1A = now + delta;
+}
+#else
+#define clock_catch_up()
+#endif
+
+/*
+ * Called from the Timer1 compare interrupt
+ */
 inline void
 clock_increment(void)
 {
+#if AVR_FEATURE_CLOCK_TICKLESS
+    clock_catch_up();
+    clock_program_compare();
+#else
     tick_10ms++;
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+    clock_wall_tick();
+
+    /*
+     * The counter has just been reset, so a new TOP takes effect for the
+     * tick that is starting now
+     */
+    int16_t step    = clock_slew_step();
+
+    if (step || slewing)
+    {
+        OCR1A = CLOCK_COUNTS_PER_TICK - step;
+        slew_counts -= step;
+        slewing = (step != 0);
+    }
+#endif
+#endif
 }
 
 void
 clock_init(void)
 {
+#if AVR_FEATURE_CLOCK_TICKLESS
+    // set clock source to external / 256
+    sbi(TCCR1B, CS12);
+    cbi(TCCR1B, CS11);
+    cbi(TCCR1B, CS10);
+
+    // set counter to normal mode (count through 0xffff)
+    cbi(TCCR1B, WGM13);
+    cbi(TCCR1B, WGM12);
+    cbi(TCCR1A, WGM11);
+    cbi(TCCR1A, WGM10);
+
+    tick_base = TCNT1;
+    tick_frac = 0;
+    wake_set = 0;
+    OCR1A = tick_base + MAX_SLEEP_COUNTS;
+#else
     // set clock source to external / 8
     cbi(TCCR1B, CS12);
     sbi(TCCR1B, CS11);
@@ -34,7 +285,8 @@ clock_init(void)
     // set counter MAX to 7813
     // 6.25MHz / 8 / 7813 -> 99.994 Hz ~ 10.001 ms
     // OCR1A = 7813;
-    OCR1A = F_CPU / 8L / 100L;
+    OCR1A = CLOCK_COUNTS_PER_TICK;
+#endif
 
     // enable interrupts on timer match
     sbi(TIMSK1, OCIE1A);
@@ -46,8 +298,248 @@ clock_init(void)
     cbi(PRR, PRTIM1);
 }
 
-inline uint32_t
+/*
+ * The tick count is 4 bytes, so it has to be read with interrupts off, or
+ * the ISR could update it half way through
+ */
+uint32_t
 clock_current_time(void)
 {
-    return tick_10ms;
+    uint32_t    t;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        clock_catch_up();
+        t = tick_10ms;
+    }
+
+    return t;
+}
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+/*
+ * Arrange for an interrupt (to wake the CPU if it is sleeping) by the time
+ * the clock reaches tick.  Only the earliest wakeup still to come is kept;
+ * it is cleared once it has passed.
+ */
+void
+clock_set_wakeup(uint32_t tick)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        clock_catch_up();
+
+        if
+        (
+            !wake_set
+            ||
+            !clock_time_before(tick_10ms, wake_tick)
+            ||
+            clock_time_before(tick, wake_tick)
+        )
+        {
+            wake_tick = tick;
+            wake_set = 1;
+            clock_program_compare();
+        }
+    }
+}
+#endif
+
+/*
+ * Read the tick count and the timer count within the tick together.  If
+ * the timer has reached TOP but the interrupt hasn't been handled yet (we
+ * may be in another ISR, or the timer may have just got there), the tick
+ * it started is counted here.
+ */
+static void
+clock_read_counts(uint32_t *ticks, uint16_t *counts)
+{
+    uint32_t    t;
+    uint16_t    c;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+#if AVR_FEATURE_CLOCK_TICKLESS
+        clock_catch_up();
+        t = tick_10ms;
+        c = TCNT1 - tick_base;
+#else
+        t = tick_10ms;
+        c = TCNT1;
+
+        if (TIFR1 & _BV(OCF1A))
+        {
+            t++;
+
+            // read again, as it may have been at TOP before
+            c = TCNT1;
+            if (c >= OCR1A)
+                c = 0;
+        }
+#endif
+    }
+
+    // a lengthened tick (while slewing) mustn't run into the next one
+    if (c >= CLOCK_COUNTS_PER_TICK)
+        c = CLOCK_COUNTS_PER_TICK - 1;
+
+    *ticks = t;
+    *counts = c;
+}
+
+/*
+ * Monotonic time in microseconds.  The resolution is one timer count,
+ * CLOCK_PRESCALE / F_CPU seconds; it wraps after about 71 minutes.
+ */
+uint32_t
+clock_now_us(void)
+{
+    uint32_t    t;
+    uint16_t    c;
+
+    clock_read_counts(&t, &c);
+
+    return t * 10000UL + (uint32_t)c * 10000UL / CLOCK_COUNTS_PER_TICK;
+}
+
+/*
+ * Monotonic time in CPU cycles, to a resolution of one timer count
+ * (CLOCK_PRESCALE cycles).  This wraps quickly (after 2^32 / F_CPU
+ * seconds), so it is only good for timing short stretches of code.
+ */
+uint32_t
+clock_now_cycles(void)
+{
+    uint32_t    t;
+    uint16_t    c;
+
+    clock_read_counts(&t, &c);
+
+    return t * (F_CPU / CLOCK_TICKS_PER_SEC) + (uint32_t)c * CLOCK_PRESCALE;
+}
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+/*
+ * Read the wall clock.  Returns the Unix time; if ticks isn't 0, the 10ms
+ * ticks into the current second are also returned.
+ */
+uint32_t
+clock_wall_time(uint8_t *ticks)
+{
+    uint32_t    secs;
+    uint8_t     t;
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        clock_catch_up();
+        secs = wall_secs;
+        t = wall_ticks;
+    }
+
+    if (ticks)
+        *ticks = t;
+
+    return secs;
+}
+
+/*
+ * Step the wall clock to a new time
+ */
+void
+clock_set_wall_time(uint32_t secs, uint8_t ticks)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        clock_catch_up();
+        wall_secs = secs;
+        wall_ticks = ticks;
+    }
+
+    wall_stats.valid = 1;
+    wall_stats.set_secs = secs;
+    wall_stats.set_ticks = ticks;
+}
+
+/*
+ * Correct the wall clock from a reference time, keeping track of how far
+ * it had drifted
+ */
+void
+clock_sync_wall_time(uint32_t secs, uint8_t ticks)
+{
+    uint8_t     local_ticks;
+    uint32_t    local_secs  = clock_wall_time(&local_ticks);
+    int32_t     dsecs       = (int32_t)(secs - local_secs);
+    uint32_t    now         = clock_current_time();
+
+    if (wall_stats.valid && dsecs > -CLOCK_MAX_DRIFT_SECS && dsecs < CLOCK_MAX_DRIFT_SECS)
+    {
+        int32_t     offset  = dsecs * CLOCK_TICKS_PER_SEC + ticks - local_ticks;
+        uint32_t    elapsed = now - last_sync;
+        int32_t     mag     = offset < 0 ? -offset : offset;
+
+        wall_stats.last_offset = offset;
+        if (mag > wall_stats.max_offset)
+            wall_stats.max_offset = mag;
+
+        // parts per million, if long enough since the last sync to mean much
+        if (elapsed >= CLOCK_TICKS_PER_SEC * 60L)
+            wall_stats.drift_ppm = offset * 10000L / (int32_t)(elapsed / 100);
+    }
+
+    wall_stats.syncs++;
+    last_sync = now;
+
+    clock_set_wall_time(secs, ticks);
+}
+
+void
+clock_get_wall_stats(clock_wall_stats_t *stats)
+{
+    *stats = wall_stats;
+}
+
+uint8_t
+clock_wall_time_valid(void)
+{
+    return wall_stats.valid;
+}
+
+/*
+ * Read the wall clock as an NTP timestamp (seconds since 1900, and 32 bit
+ * binary fraction)
+ */
+void
+clock_get_ntp_time(uint32_t *secs, uint32_t *frac)
+{
+    uint8_t ticks;
+
+    *secs = clock_wall_time(&ticks) + UNIX_EPOCH_OFFSET;
+    *frac = ticks * (0xffffffffUL / CLOCK_TICKS_PER_SEC + 1);
+}
+
+/*
+ * Gradually correct the wall clock by offset (seconds, in 16.16 fixed
+ * point; positive if the clock is behind).  This replaces any correction
+ * still in progress.  The clock is slewed by at least 500ppm, so a 1s
+ * correction takes at most 33 minutes; larger offsets should be stepped instead.
+ */
+void
+clock_slew(int32_t offset)
+{
+    uint32_t    mag     = offset < 0 ? -offset : offset;
+    int32_t     counts;
+
+    if (mag > CLOCK_MAX_SLEW)
+        mag = CLOCK_MAX_SLEW;
+
+    counts = (mag >> 16) * CLOCK_COUNTS_PER_SEC
+        + (((mag & 0xffff) * (CLOCK_COUNTS_PER_SEC >> 8)) >> 8);
+
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        slew_counts = offset < 0 ? -counts : counts;
+    }
 }
+#endif /* AVR_FEATURE_CLOCK_WALL_TIME */
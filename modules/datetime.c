@@ -0,0 +1,164 @@
+/*
+ * Calendar conversions for UTC times
+ *
+ * Days are counted from 1970-01-01.  The conversions between days and
+ * year/month/day use Howard Hinnant's algorithms ("chrono-Compatible
+ * Low-Level Date Algorithms"), which work in a calendar that starts on
+ * 1 March so that the leap day falls at the end of the year.  They take
+ * the same time for any date, with no loops over years or months.
+ */
+#include <avr/pgmspace.h>
+
+#include "avr-common.h"
+#include "datetime.h"
+
+/*
+ * Days from 0000-03-01 to 1970-01-01
+ */
+#define DAYS_TO_EPOCH       719468UL
+#define DAYS_PER_ERA        146097UL    /* 400 years */
+
+static const char   day_names[] PROGMEM = "SunMonTueWedThuFriSat";
+static const char   month_names[] PROGMEM = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+void
+datetime_civil_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day)
+{
+    uint32_t    z       = days + DAYS_TO_EPOCH;
+    uint16_t    era     = z / DAYS_PER_ERA;
+    uint32_t    doe     = z - era * DAYS_PER_ERA;                   // [0, 146096]
+    uint16_t    yoe     = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    uint16_t    doy     = doe - (365UL * yoe + yoe / 4 - yoe / 100);   // [0, 365]
+    uint8_t     mp      = (5 * doy + 2) / 153;                      // [0, 11], from March
+    uint8_t     m       = mp < 10 ? mp + 3 : mp - 9;
+
+    *day = doy - (153 * mp + 2) / 5 + 1;
+    *month = m;
+    *year = era * 400 + yoe + (m <= 2);
+}
+
+uint32_t
+datetime_days_from_civil(uint16_t year, uint8_t month, uint8_t day)
+{
+    uint16_t    y       = year - (month <= 2);
+    uint16_t    era     = y / 400;
+    uint16_t    yoe     = y - era * 400;                            // [0, 399]
+    uint16_t    doy     = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    uint32_t    doe     = 365UL * yoe + yoe / 4 - yoe / 100 + doy;  // [0, 146096]
+
+    return era * DAYS_PER_ERA + doe - DAYS_TO_EPOCH;
+}
+
+/*
+ * 1970-01-01 was a Thursday
+ */
+uint8_t
+datetime_weekday(uint32_t days)
+{
+    return (days + 4) % 7;
+}
+
+/*
+ * Break down a Unix time (seconds since 1970)
+ */
+void
+datetime_from_unix(uint32_t t, datetime_t *dt)
+{
+    uint32_t    days    = t / SECONDS_PER_DAY;
+    uint32_t    secs    = t - days * SECONDS_PER_DAY;
+    uint16_t    mins    = secs / 60;
+
+    dt->sec = secs - mins * 60UL;
+    dt->hour = mins / 60;
+    dt->min = mins - dt->hour * 60;
+    dt->wday = datetime_weekday(days);
+
+    datetime_civil_from_days(days, &dt->year, &dt->month, &dt->day);
+}
+
+uint32_t
+datetime_to_unix(const datetime_t *dt)
+{
+    return datetime_days_from_civil(dt->year, dt->month, dt->day) * SECONDS_PER_DAY
+        + dt->hour * 3600UL + dt->min * 60 + dt->sec;
+}
+
+static char *
+datetime_put_2digits(char *p, uint8_t x)
+{
+    *p++ = '0' + x / 10;
+    *p++ = '0' + x % 10;
+
+    return p;
+}
+
+static char *
+datetime_put_4digits(char *p, uint16_t x)
+{
+    p = datetime_put_2digits(p, x / 100);
+
+    return datetime_put_2digits(p, x % 100);
+}
+
+static char *
+datetime_put_name(char *p, const char *names, uint8_t i)
+{
+    for (uint8_t j = 0; j < 3; j++)
+        *p++ = pgm_read_byte(&names[i * 3 + j]);
+
+    return p;
+}
+
+/*
+ * Format as for an HTTP Date header (RFC 1123), e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT".  buf must hold DATETIME_HTTP_LEN bytes.
+ */
+void
+datetime_format_http(const datetime_t *dt, char *buf)
+{
+    char    *p  = buf;
+
+    p = datetime_put_name(p, day_names, dt->wday);
+    *p++ = ',';
+    *p++ = ' ';
+    p = datetime_put_2digits(p, dt->day);
+    *p++ = ' ';
+    p = datetime_put_name(p, month_names, dt->month - 1);
+    *p++ = ' ';
+    p = datetime_put_4digits(p, dt->year);
+    *p++ = ' ';
+    p = datetime_put_2digits(p, dt->hour);
+    *p++ = ':';
+    p = datetime_put_2digits(p, dt->min);
+    *p++ = ':';
+    p = datetime_put_2digits(p, dt->sec);
+    *p++ = ' ';
+    *p++ = 'G';
+    *p++ = 'M';
+    *p++ = 'T';
+    *p = '\0';
+}
+
+/*
+ * Format as ISO 8601, e.g. "1994-11-06T08:49:37Z".  buf must hold
+ * DATETIME_ISO_LEN bytes.
+ */
+void
+datetime_format_iso(const datetime_t *dt, char *buf)
+{
+    char    *p  = buf;
+
+    p = datetime_put_4digits(p, dt->year);
+    *p++ = '-';
+    p = datetime_put_2digits(p, dt->month);
+    *p++ = '-';
+    p = datetime_put_2digits(p, dt->day);
+    *p++ = 'T';
+    p = datetime_put_2digits(p, dt->hour);
+    *p++ = ':';
+    p = datetime_put_2digits(p, dt->min);
+    *p++ = ':';
+    p = datetime_put_2digits(p, dt->sec);
+    *p++ = 'Z';
+    *p = '\0';
+}
@@ -3,8 +3,45 @@
  */
 #include "avr-common.h"
 #include "one-wire.h"
+#include "crc8.h"
 #include "ds1820.h"
 
+#if AVR_FEATURE_TASKS
+#include "clock.h"
+#include "task.h"
+#endif
+
+#if AVR_FEATURE_DS1820_PERSIST_ROMS
+#include <avr/eeprom.h>
+#endif
+
+#ifdef AVR_FEATURE_DS1820_MAX_SENSORS
+# define MAX_SENSORS    AVR_FEATURE_DS1820_MAX_SENSORS
+#else
+# define MAX_SENSORS    8
+#endif
+
+/*
+ * Scratchpad layout
+ */
+#define SP_TEMP_LSB         0
+#define SP_TEMP_MSB         1
+#define SP_TH               2
+#define SP_TL               3
+#define SP_CONFIG           4   /* DS18B20/DS1822; always 0xff on a DS18S20 */
+#define SP_COUNT_REMAIN     6   /* DS18S20 */
+#define SP_COUNT_PER_C      7   /* DS18S20 */
+
+#define SP_CONFIG_DS18S20   0xff
+
+/*
+ * Conversion time for each DS18B20 resolution, in 10ms clock ticks
+ * (93.75, 187.5, 375 and 750ms, rounded up)
+ */
+static const uint8_t    conversion_ticks[] = { 10, 19, 38, 76 };
+
+static uint8_t          resolution  = 12;
+
 /*
  * Convert T
  */
@@ -17,38 +54,639 @@ ds1820_cmd_convert_t(void)
 }
 
 /*
- * Read Scratchpad
+ * Convert T on all sensors, without waiting for it to complete
  */
 void
+ds1820_start_convert_t(void)
+{
+    onewire_reset((uint8_t *)0);
+    onewire_send_byte(OW_CMD_SKIP_ROM);
+    onewire_send_byte(OW_CMD_CONVERT_T);
+}
+
+/*
+ * Poll a read time slot: the sensors hold the bus low until the
+ * conversion has finished.  (This doesn't work with parasite power.)
+ */
+uint8_t
+ds1820_conversion_done(void)
+{
+    return onewire_recv_bit();
+}
+
+/*
+ * Read Scratchpad.  Returns non-zero if the CRC doesn't match.
+ */
+uint8_t
 ds1820_cmd_read_scratchpad(uint8_t *x)
 {
     onewire_send_byte(OW_CMD_READ_SCRATCHPAD);
 
     for (uint8_t i = 0; i < 9; i++)
         x[i] = onewire_recv_byte();
+
+    return crc8(x, 9) != 0;
 }
 
 /*
- * Get the temperature from the DS1820 sensor.
+ * Address a sensor (or all sensors, if rom is 0) and read its scratchpad.
+ * A corrupt read is retried once; the conversion result stays in the
+ * scratchpad, so there is no need to convert again.
+ */
+static uint8_t
+ds1820_read_scratchpad_from(const uint64_t *rom, uint8_t *mem)
+{
+    uint8_t detect;
+
+    for (uint8_t tries = 0; tries < 2; tries++)
+    {
+        onewire_reset(&detect);
+        if (!detect)
+            continue;
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+        if (rom)
+            onewire_cmd_match_rom(*rom);
+        else
+#endif
+            onewire_send_byte(OW_CMD_SKIP_ROM);
+
+        if (ds1820_cmd_read_scratchpad(mem) == 0)
+            return 0;
+    }
+
+    return 1;
+}
+
+/*
+ * Extract the temperature from the scratchpad, in 1/16ths of a degree C.
+ *
+ * The DS18S20 reports half degrees; COUNT_REMAIN gives the extra precision
+ * (see the "Operation - Measuring Temperature" section of the data sheet).
+ * The DS18B20 and DS1822 report 1/16ths of a degree, with the low bits
+ * undefined at less than 12 bit resolution.
+ */
+static int16_t
+ds1820_decode_temperature(const uint8_t *mem)
+{
+    int16_t raw = (int16_t)((mem[SP_TEMP_MSB] << 8) | mem[SP_TEMP_LSB]);
+
+    if (mem[SP_CONFIG] == SP_CONFIG_DS18S20)
+    {
+        if (mem[SP_COUNT_PER_C] != 16)
+            return raw * 8;
+
+        // T = TEMP_READ - 0.25 + (COUNT_PER_C - COUNT_REMAIN) / COUNT_PER_C
+        return (raw & ~1) * 8 - 4 + (16 - mem[SP_COUNT_REMAIN]);
+    }
+
+    uint8_t bits    = 9 + ((mem[SP_CONFIG] >> 5) & 0x03);
+
+    return raw & ~((1 << (12 - bits)) - 1);
+}
+
+/*
+ * Split a temperature into whole and half degrees, for the older interface
+ */
+static void
+ds1820_split_temperature(int16_t t, uint8_t *degrees, uint8_t *half)
+{
+    *degrees = (uint8_t)(t >> DS1820_FRAC_BITS);
+
+    if (half)
+        *half = (t >> (DS1820_FRAC_BITS - 1)) & 0x01;
+}
+
+/*
+ * Get the temperature from the DS1820 sensor, in 1/16ths of a degree C.
  * The protocol is described in the Maxim DS1820 data sheet.
+ * Returns non-zero if the sensor couldn't be read.
  */
-void
-ds1820_get_temperature(uint8_t *degrees, uint8_t *half)
+uint8_t
+ds1820_get_temperature_fixed(int16_t *t)
 {
     uint8_t mem[9];
 
-    mem[0] = 0;
-
     onewire_reset((uint8_t *)0);
     onewire_send_byte(OW_CMD_SKIP_ROM);
     ds1820_cmd_convert_t();
 
+    if (ds1820_read_scratchpad_from(0, mem) != 0)
+        return 1;
+
+    *t = ds1820_decode_temperature(mem);
+
+    return 0;
+}
+
+uint8_t
+ds1820_get_temperature(uint8_t *degrees, uint8_t *half)
+{
+    int16_t t;
+
+    if (ds1820_get_temperature_fixed(&t) != 0)
+        return 1;
+
+    ds1820_split_temperature(t, degrees, half);
+
+    return 0;
+}
+
+#define CONFIG_OK           0
+#define CONFIG_FAILED       1
+#define CONFIG_DS18S20      2   /* no configuration register; left alone */
+
+/*
+ * Write the configuration register of one sensor (or all sensors, if rom
+ * is 0), keeping the alarm thresholds, and read it back to check it.
+ */
+static uint8_t
+ds18b20_write_config(const uint64_t *rom, uint8_t config)
+{
+    uint8_t mem[9];
+
+    if (ds1820_read_scratchpad_from(rom, mem) != 0)
+        return CONFIG_FAILED;
+
+    if (mem[SP_CONFIG] == SP_CONFIG_DS18S20)
+        return CONFIG_DS18S20;
+
+    onewire_reset((uint8_t *)0);
+#if AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+    if (rom)
+        onewire_cmd_match_rom(*rom);
+    else
+#endif
+        onewire_send_byte(OW_CMD_SKIP_ROM);
+
+    onewire_send_byte(OW_CMD_WRITE_SCRATCHPAD);
+    onewire_send_byte(mem[SP_TH]);
+    onewire_send_byte(mem[SP_TL]);
+    onewire_send_byte(config);
+
+    // check that it took
+    if (ds1820_read_scratchpad_from(rom, mem) != 0 || mem[SP_CONFIG] != config)
+        return CONFIG_FAILED;
+
+    return CONFIG_OK;
+}
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+
+/*
+ * Support for several sensors on one bus.  The bus is enumerated once with
+ * Search ROM and the ROM IDs cached; conversions are started on all sensors
+ * at once with Skip ROM, and each sensor is then read with Match ROM.
+ */
+static uint64_t sensor_rom[MAX_SENSORS];
+static uint8_t  n_sensors;
+
+#if AVR_FEATURE_DS1820_PERSIST_ROMS
+/*
+ * Copy of the sensor table kept in EEPROM, so that the bus doesn't need to
+ * be searched on every boot.  The CRC covers the count and the ROM IDs.
+ */
+typedef struct
+{
+    uint8_t     count;
+    uint64_t    rom[MAX_SENSORS];
+    uint8_t     crc;
+}
+    ds1820_rom_table_t;
+
+static ds1820_rom_table_t EEMEM ee_rom_table;
+
+static uint8_t
+ds1820_rom_table_crc(void)
+{
+    const uint8_t   *p      = (const uint8_t *)sensor_rom;
+    uint8_t         crc     = crc8_update(0, n_sensors);
+
+    for (uint16_t i = 0; i < n_sensors * sizeof(uint64_t); i++)
+        crc = crc8_update(crc, p[i]);
+
+    return crc;
+}
+
+/*
+ * Write the sensor table to EEPROM.  Only changed bytes are written.
+ */
+static void
+ds1820_save_sensors(void)
+{
+    eeprom_update_byte(&ee_rom_table.count, n_sensors);
+    eeprom_update_block(sensor_rom, ee_rom_table.rom, n_sensors * sizeof(uint64_t));
+    eeprom_update_byte(&ee_rom_table.crc, ds1820_rom_table_crc());
+}
+#endif /* AVR_FEATURE_DS1820_PERSIST_ROMS */
+
+/*
+ * Enumerate the temperature sensors on the bus, returning the number found
+ */
+uint8_t
+ds1820_scan_sensors(void)
+{
+    uint64_t    rom;
+    uint8_t     found;
+
+    n_sensors = 0;
+
+    for (found = onewire_scan_first(&rom); found; found = onewire_scan_next(&rom))
+    {
+        uint8_t family  = (uint8_t)(rom & 0xff);
+
+        if
+        (
+            family != DS1820_FAMILY_DS18S20
+            &&
+            family != DS1820_FAMILY_DS1822
+            &&
+            family != DS1820_FAMILY_DS18B20
+        )
+            continue;
+
+        if (n_sensors == MAX_SENSORS)
+            break;
+
+        sensor_rom[n_sensors++] = rom;
+    }
+
+#if AVR_FEATURE_DS1820_PERSIST_ROMS
+    if (n_sensors > 0)
+        ds1820_save_sensors();
+#endif
+
+    return n_sensors;
+}
+
+#if AVR_FEATURE_DS1820_PERSIST_ROMS
+/*
+ * Restore the sensor table saved by the last scan, and check that each of
+ * those sensors still answers to its ROM ID with a valid scratchpad.  The
+ * bus is only searched again if the saved table is missing or corrupt, or
+ * a sensor doesn't respond.  (A sensor added to the bus since the last
+ * scan won't be noticed; call ds1820_scan_sensors() to pick it up.)
+ * Returns the number of sensors.
+ */
+uint8_t
+ds1820_load_sensors(void)
+{
+    uint8_t detect;
+    uint8_t mem[9];
+
+    onewire_reset(&detect);
+    if (!detect)
+    {
+        n_sensors = 0;
+        return 0;
+    }
+
+    n_sensors = eeprom_read_byte(&ee_rom_table.count);
+    if (n_sensors == 0 || n_sensors > MAX_SENSORS)
+        goto RESCAN;
+
+    eeprom_read_block(sensor_rom, ee_rom_table.rom, n_sensors * sizeof(uint64_t));
+    if (eeprom_read_byte(&ee_rom_table.crc) != ds1820_rom_table_crc())
+        goto RESCAN;
+
+    for (uint8_t i = 0; i < n_sensors; i++)
+    {
+        if (ds1820_read_scratchpad_from(&sensor_rom[i], mem) != 0)
+            goto RESCAN;
+    }
+
+    return n_sensors;
+
+RESCAN:
+    return ds1820_scan_sensors();
+}
+#endif /* AVR_FEATURE_DS1820_PERSIST_ROMS */
+
+uint8_t
+ds1820_sensor_count(void)
+{
+    return n_sensors;
+}
+
+uint64_t
+ds1820_sensor_rom(uint8_t sensor)
+{
+    return sensor < n_sensors ? sensor_rom[sensor] : 0;
+}
+
+/*
+ * Start a conversion on every sensor and wait for them all to finish
+ */
+void
+ds1820_convert_all(void)
+{
     onewire_reset((uint8_t *)0);
     onewire_send_byte(OW_CMD_SKIP_ROM);
-    ds1820_cmd_read_scratchpad(mem);
+    ds1820_cmd_convert_t();
+}
 
-    *degrees = mem[0] >> 1;
+/*
+ * Read the result of the last conversion from one sensor, in 1/16ths of a
+ * degree C.  Returns non-zero if the sensor couldn't be read.
+ */
+uint8_t
+ds1820_read_sensor_fixed(uint8_t sensor, int16_t *t)
+{
+    uint8_t mem[9];
 
-    if (half)
-        *half = mem[0] & 0x01 ? 1 : 0;
+    if (sensor >= n_sensors)
+        return 1;
+
+    if (ds1820_read_scratchpad_from(&sensor_rom[sensor], mem) != 0)
+        return 1;
+
+    *t = ds1820_decode_temperature(mem);
+
+    return 0;
+}
+
+uint8_t
+ds1820_read_sensor(uint8_t sensor, uint8_t *degrees, uint8_t *half)
+{
+    int16_t t;
+
+    if (ds1820_read_sensor_fixed(sensor, &t) != 0)
+        return 1;
+
+    ds1820_split_temperature(t, degrees, half);
+
+    return 0;
+}
+#endif /* AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM */
+
+/*
+ * Set the resolution (9 to 12 bits) of the DS18B20/DS1822 sensors on the
+ * bus; DS18S20 sensors always convert at full resolution.  Lower resolutions
+ * convert faster: from 94ms at 9 bits to 750ms at 12 bits.  The setting isn't
+ * copied to the sensors' EEPROM, so it reverts at power-up.
+ *
+ * The resolution used for conversion deadlines only drops below 12 bits
+ * once every sensor has been written and checked, and none is a DS18S20;
+ * otherwise some sensor may still take the full 750ms.
+ * Returns non-zero if a sensor couldn't be configured.
+ */
+uint8_t
+ds18b20_set_resolution(uint8_t bits)
+{
+    uint8_t config;
+    uint8_t status  = CONFIG_OK;
+
+    if (bits < 9 || bits > 12)
+        return 1;
+
+    config = ((bits - 9) << 5) | 0x1f;
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+    if (n_sensors > 0)
+    {
+        for (uint8_t i = 0; i < n_sensors; i++)
+            status |= ds18b20_write_config(&sensor_rom[i], config);
+    }
+    else
+#endif
+        status = ds18b20_write_config(0, config);
+
+    resolution = status == CONFIG_OK ? bits : 12;
+
+    return (status & CONFIG_FAILED) != 0;
+}
+
+uint8_t
+ds18b20_get_resolution(void)
+{
+    return resolution;
+}
+
+#if AVR_FEATURE_TASKS
+
+/*
+ * Split-phase conversion: start the conversion and return straight away,
+ * then poll for completion from the task scheduler once per clock tick.
+ * The scratchpads are read back when the sensors report they are done, or
+ * when the conversion time for the current resolution has passed: one
+ * sensor per run of the task, so that other tasks get to run in between.
+ * With AVR_FEATURE_ONEWIRE_ENABLE_ASYNC each read is done in the background
+ * by the Timer2 engine, and the task is woken when it has finished.
+ */
+static ds1820_temperature_callback_t    *conversion_callback;
+static uint8_t                          read_sensor;    // next to read back
+static uint8_t                          read_tries;
+
+#define READ_WAITING    0xff    /* read_sensor while the conversion runs */
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+static uint8_t          read_tx[10];
+static uint8_t          read_mem[9];
+static volatile uint8_t read_busy;
+static task_handle_t    poll_task;
+#endif
+
+/*
+ * How long a conversion can take.  A DS18S20 on the bus always takes the
+ * full 750ms (and resolution is left at 12 if one answered the last
+ * ds18b20_set_resolution(), even if it wasn't in the scanned table).
+ */
+static uint8_t
+ds1820_conversion_ticks(void)
+{
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+    for (uint8_t i = 0; i < n_sensors; i++)
+    {
+        if ((uint8_t)(sensor_rom[i] & 0xff) == DS1820_FAMILY_DS18S20)
+            return conversion_ticks[3];
+    }
+#endif
+
+    return conversion_ticks[resolution - 9];
+}
+
+/*
+ * The sensors to read back: those in the scanned table, or else the only
+ * one on the bus (addressed with Skip ROM)
+ */
+static uint8_t
+ds1820_read_count(void)
+{
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+    if (n_sensors > 0)
+        return n_sensors;
+#endif
+
+    return 1;
+}
+
+static const uint64_t *
+ds1820_read_rom(uint8_t sensor)
+{
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM && AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+    if (n_sensors > 0)
+        return &sensor_rom[sensor];
+#endif
+
+    return 0;
+}
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+/*
+ * Called from the Timer2 interrupt when a scratchpad read has finished
+ */
+static void
+ds1820_read_done(uint8_t status)
+{
+    read_busy = 0;
+    task_wake(poll_task);
+}
+
+/*
+ * Start reading the scratchpad of sensor read_sensor in the background.
+ * Returns non-zero if the transfer couldn't be started.
+ */
+static uint8_t
+ds1820_start_read(void)
+{
+    uint8_t         n       = 0;
+#if AVR_FEATURE_ONEWIRE_ENABLE_MATCHROM
+    const uint64_t  *rom    = ds1820_read_rom(read_sensor);
+
+    if (rom)
+    {
+        read_tx[n++] = OW_CMD_MATCH_ROM;
+        for (uint8_t i = 0; i < 8; i++)
+            read_tx[n++] = (uint8_t)(*rom >> (i * 8));
+    }
+    else
+#endif
+        read_tx[n++] = OW_CMD_SKIP_ROM;
+
+    read_tx[n++] = OW_CMD_READ_SCRATCHPAD;
+
+    read_busy = 1;
+    if (onewire_async_start(OW_ASYNC_RESET, read_tx, n, read_mem, sizeof(read_mem), ds1820_read_done) != 0)
+    {
+        read_busy = 0;
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * Deal with the read that has just finished, retrying a corrupt read once,
+ * and start the next.  Returns 1 once every sensor has been read.
+ */
+static uint8_t
+ds1820_read_next(void)
+{
+    if (read_sensor != READ_WAITING)
+    {
+        if (onewire_async_status() == OW_ASYNC_OK && crc8(read_mem, 9) == 0)
+            (*conversion_callback)(read_sensor, ds1820_decode_temperature(read_mem));
+        else
+        if (++read_tries < 2 && ds1820_start_read() == 0)
+            return 0;
+
+        read_sensor++;
+    }
+    else
+    {
+        read_sensor = 0;
+    }
+
+    for (; read_sensor < ds1820_read_count(); read_sensor++)
+    {
+        read_tries = 0;
+        if (ds1820_start_read() == 0)
+            return 0;
+    }
+
+    return 1;
+}
+#else
+/*
+ * Read back the next sensor.  Returns 1 once every sensor has been read.
+ */
+static uint8_t
+ds1820_read_next(void)
+{
+    uint8_t mem[9];
+
+    if (read_sensor == READ_WAITING)
+        read_sensor = 0;
+
+    if (ds1820_read_scratchpad_from(ds1820_read_rom(read_sensor), mem) == 0)
+        (*conversion_callback)(read_sensor, ds1820_decode_temperature(mem));
+
+    return ++read_sensor >= ds1820_read_count();
+}
+#endif
+
+static uint32_t
+ds1820_poll_task(uint32_t now, uint32_t *data)
+{
+    uint32_t    deadline    = *data;
+
+    if
+    (
+        read_sensor == READ_WAITING
+        &&
+        clock_time_before(now, deadline)
+        &&
+        !ds1820_conversion_done()
+    )
+        return now + 1;
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+    // woken by ds1820_read_done() when the read finishes
+    if (read_busy)
+        return now + 1;
+#endif
+
+    if (!ds1820_read_next())
+        return now + 1;
+
+    conversion_callback = 0;
+
+    return 0;
+}
+
+/*
+ * Start a conversion on all sensors.  The callback is called (from
+ * task_run_ready()) with the result from each sensor that could be read
+ * back with a valid CRC.  Returns non-zero if there is no callback, a
+ * conversion is already in progress or there is no free task slot.
+ */
+uint8_t
+ds1820_start_temperature(ds1820_temperature_callback_t *callback)
+{
+    uint32_t        now;
+    task_handle_t   handle;
+
+    if (!callback || conversion_callback)
+        return 1;
+
+    conversion_callback = callback;
+    read_sensor = READ_WAITING;
+
+    ds1820_start_convert_t();
+
+    now = clock_current_time();
+
+    handle = task_submit(now + 1, 0, ds1820_poll_task, now + ds1820_conversion_ticks());
+    if (handle == TASK_INVALID)
+    {
+        conversion_callback = 0;
+        return 1;
+    }
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+    poll_task = handle;
+#endif
+
+    return 0;
 }
+#endif /* AVR_FEATURE_TASKS */
@@ -0,0 +1,267 @@
+/*
+ * Compact time series storage
+ *
+ * Each sample after the oldest is stored as a header byte followed by
+ * variable-length fields.  Bit 0 of the header is set if the time step
+ * differs from the previous one, and bit n+1 if value n has changed; only
+ * those fields follow.  The time field is the change in time step, and the
+ * value fields the change in value, each zigzag encoded (so that small
+ * negative numbers are small) and written 7 bits per byte, least
+ * significant first, with the top bit set on all but the last byte.
+ * A regularly sampled, slowly changing series takes 1-3 bytes per sample,
+ * rather than 12.
+ *
+ * When the ring is full the oldest sample is dropped.  If the history has a
+ * coarse tier, dropped samples are averaged in groups of 'ratio' and the
+ * averages appended to it, so the coarse tier extends the history back at
+ * a lower resolution.
+ *
+ * A history must not be appended to while it is being read.
+ */
+#include "avr-common.h"
+#include "history.h"
+
+#define HF_TIME     0x01
+
+static uint32_t
+history_zigzag(int32_t x)
+{
+    return ((uint32_t)x << 1) ^ (uint32_t)(x >> 31);
+}
+
+static int32_t
+history_unzigzag(uint32_t x)
+{
+    return (int32_t)(x >> 1) ^ -(int32_t)(x & 0x01);
+}
+
+static uint8_t
+history_put_varint(uint8_t *p, uint32_t x)
+{
+    uint8_t n   = 0;
+
+    while (x >= 0x80)
+    {
+        p[n++] = (uint8_t)x | 0x80;
+        x >>= 7;
+    }
+    p[n++] = (uint8_t)x;
+
+    return n;
+}
+
+static uint8_t
+history_get_byte(const history_t *h, uint16_t *pos)
+{
+    uint8_t x   = h->buf[*pos];
+
+    if (++*pos == h->size)
+        *pos = 0;
+
+    return x;
+}
+
+static uint32_t
+history_get_varint(const history_t *h, uint16_t *pos)
+{
+    uint32_t    x       = 0;
+    uint8_t     shift   = 0;
+    uint8_t     b;
+
+    do
+    {
+        b = history_get_byte(h, pos);
+        x |= (uint32_t)(b & 0x7f) << shift;
+        shift += 7;
+    }
+    while (b & 0x80);
+
+    return x;
+}
+
+/*
+ * Decode the sample at pos, which follows cur, and update cur and tdelta.
+ * The differences wrap, as they did when they were taken.
+ */
+static void
+history_decode(const history_t *h, uint16_t *pos, history_sample_t *cur, int32_t *tdelta)
+{
+    uint8_t flags   = history_get_byte(h, pos);
+
+    if (flags & HF_TIME)
+        *tdelta = (int32_t)((uint32_t)*tdelta + (uint32_t)history_unzigzag(history_get_varint(h, pos)));
+
+    cur->time += *tdelta;
+
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+    {
+        if (flags & (HF_TIME << (c + 1)))
+            cur->value[c] = (int32_t)((uint32_t)cur->value[c] + (uint32_t)history_unzigzag(history_get_varint(h, pos)));
+    }
+}
+
+static uint16_t
+history_tail(const history_t *h)
+{
+    return h->head >= h->used ? h->head - h->used : h->head + h->size - h->used;
+}
+
+/*
+ * Add a dropped sample to the coarse tier
+ */
+static void
+history_accumulate(history_t *h, const history_sample_t *s)
+{
+    if (h->acc_n == 0)
+    {
+        h->acc_time = s->time;
+
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+            h->acc[c] = 0;
+    }
+
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+        h->acc[c] += s->value[c];
+
+    if (++h->acc_n < h->ratio)
+        return;
+
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+        h->acc[c] /= h->ratio;
+
+    history_append(h->coarse, h->acc_time, h->acc);
+    h->acc_n = 0;
+}
+
+/*
+ * Drop the oldest sample: the next one is unpacked to take its place
+ */
+static void
+history_evict(history_t *h)
+{
+    uint16_t    tail    = history_tail(h);
+    uint16_t    pos     = tail;
+
+    if (h->coarse)
+        history_accumulate(h, &h->first);
+
+    history_decode(h, &pos, &h->first, &h->first_tdelta);
+
+    h->used -= pos >= tail ? pos - tail : pos + h->size - tail;
+    h->count--;
+}
+
+/*
+ * Set up a history in a byte buffer, which should be at least
+ * HISTORY_MAX_RECORD bytes.  coarse (which may be 0) is another history
+ * that receives averages of every 'ratio' samples dropped from this one.
+ * The averages are taken with 32 bit sums, so ratio times the largest
+ * value must fit in an int32_t.
+ */
+void
+history_init(history_t *h, uint8_t *buf, uint16_t size, history_t *coarse, uint8_t ratio)
+{
+    h->buf = buf;
+    h->size = size;
+    h->head = 0;
+    h->used = 0;
+    h->count = 0;
+    h->coarse = coarse;
+    h->ratio = ratio ? ratio : 1;
+    h->acc_n = 0;
+}
+
+void
+history_append(history_t *h, uint32_t time, const int32_t *values)
+{
+    uint8_t     rec[HISTORY_MAX_RECORD];
+    uint8_t     len     = 1;
+    uint8_t     flags   = 0;
+    int32_t     tdelta;
+
+    if (h->count == 0)
+    {
+        h->first.time = time;
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+            h->first.value[c] = values[c];
+        h->first_tdelta = 0;
+
+        h->last = h->first;
+        h->last_tdelta = 0;
+        h->count = 1;
+
+        return;
+    }
+
+    /*
+     * The differences are taken modulo 2^32, as a jump between extreme
+     * values would overflow an int32_t
+     */
+    tdelta = (int32_t)(time - h->last.time);
+    if (tdelta != h->last_tdelta)
+    {
+        flags |= HF_TIME;
+        len += history_put_varint(&rec[len], history_zigzag((int32_t)((uint32_t)tdelta - (uint32_t)h->last_tdelta)));
+    }
+
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+    {
+        if (values[c] != h->last.value[c])
+        {
+            flags |= HF_TIME << (c + 1);
+            len += history_put_varint(&rec[len], history_zigzag((int32_t)((uint32_t)values[c] - (uint32_t)h->last.value[c])));
+        }
+    }
+    rec[0] = flags;
+
+    while (h->used + len > h->size && h->count > 1)
+        history_evict(h);
+
+    for (uint8_t i = 0; i < len; i++)
+    {
+        h->buf[h->head] = rec[i];
+        if (++h->head == h->size)
+            h->head = 0;
+    }
+    h->used += len;
+    h->count++;
+
+    h->last.time = time;
+    for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+        h->last.value[c] = values[c];
+    h->last_tdelta = tdelta;
+}
+
+uint16_t
+history_count(const history_t *h)
+{
+    return h->count;
+}
+
+void
+history_iter_init(history_iter_t *it, const history_t *h)
+{
+    it->h = h;
+    it->pos = history_tail(h);
+    it->left = h->count;
+    it->cur = h->first;
+    it->tdelta = h->first_tdelta;
+}
+
+/*
+ * Get the next sample, oldest first.  Returns 0 when there are no more.
+ */
+uint8_t
+history_iter_next(history_iter_t *it, history_sample_t *sample)
+{
+    if (it->left == 0)
+        return 0;
+
+    if (it->left != it->h->count)
+        history_decode(it->h, &it->pos, &it->cur, &it->tdelta);
+
+    it->left--;
+    *sample = it->cur;
+
+    return 1;
+}
@@ -9,6 +9,14 @@
 #include "i2c.h"
 #include "hp30.h"
 
+#if AVR_FEATURE_TASKS || AVR_FEATURE_HP30_BENCHMARK
+#include "clock.h"
+#endif
+
+#if AVR_FEATURE_TASKS
+#include "task.h"
+#endif
+
 /*
  * Define I2C addresses for the HP30 barometer
  *
@@ -39,6 +47,55 @@ struct hp30_coeff_t
  */
 static struct hp30_coeff_t  hp30_c;
 
+/*
+ * Terms derived from the calibration coefficients, worked out once by
+ * hp30_init() rather than for every sample
+ */
+struct hp30_derived_t
+{
+    int32_t     c2x4;       /* c2 * 4 */
+    int16_t     c4m;        /* c4 - 1024 */
+    int32_t     d_bias;     /* 2^d - 1, for rounding a division by 2^d */
+    uint16_t    c_mul;      /* 2^(16 - c), for hp30_shr(), or 0 if c is 0 */
+    uint16_t    d_mul;      /* 2^(16 - d), likewise */
+};
+
+static struct hp30_derived_t    hp30_k;
+
+static void
+hp30_derive(void)
+{
+    hp30_k.c2x4 = (int32_t)hp30_c.c2 * 4;
+    hp30_k.c4m = hp30_c.c4 - 1024;
+    hp30_k.d_bias = (1L << hp30_c.d) - 1;
+    hp30_k.c_mul = hp30_c.c ? 1U << (16 - hp30_c.c) : 0;
+    hp30_k.d_mul = hp30_c.d ? 1U << (16 - hp30_c.d) : 0;
+}
+
+/*
+ * X >> k, for the shift count k (1 to 15) of one of the calibration
+ * coefficients.  The AVR can only shift by one bit at a time, so a shift
+ * by a variable count is a loop of up to 15 passes over the four bytes.
+ * Instead, X times 2^(16 - k) is worked out as two 16x16 bit multiplies
+ * of its halves, and shifted right by a constant 16 bits.
+ */
+static inline int32_t
+hp30_shr(int32_t x, uint16_t mul)
+{
+    if (mul == 0)
+        return x;
+
+    return (int32_t)(int16_t)(x >> 16) * (int32_t)mul
+        + (uint16_t)(((uint32_t)(uint16_t)x * mul) >> 16);
+}
+
+/*
+ * Signed division by 2^K, rounding towards zero like the '/' operator, but
+ * without a call to the library division routine.  N must be an int32_t
+ * variable.
+ */
+#define HP30_DIV_POW2(N, K) (((N) + (((N) >> 31) & ((1L << (K)) - 1))) >> (K))
+
 /*
  * XCLR (enable-high) pin
  */
@@ -84,86 +141,250 @@ hp30_init(uint8_t volatile *port, uint8_t volatile *ddr, uint8_t pin)
     hp30_c.c = i2c_read_byte_ack();
     hp30_c.d = i2c_read_byte_ack();
     i2c_stop();
+
+    hp30_derive();
 }
 
-void
-hp30_read_values(hp30_measure_t *values)
+/*
+ * Commands to start each of the conversions
+ */
+#define HP30_CONVERT_TEMPERATURE    0xe8
+#define HP30_CONVERT_PRESSURE       0xf0
+
+/*
+ * Start a conversion.  XCLR must already be high.
+ */
+static uint8_t
+hp30_start_conversion(uint8_t command)
+{
+    uint8_t err;
+
+    if ((err = i2c_start(HP30_ADDR_SENSOR, I2C_SLA_W)) != 0)
+        goto ERROR;
+    if ((err = i2c_send_byte(0xff)) != 0)
+        goto ERROR;
+    if ((err = i2c_send_byte(command)) != 0)
+        goto ERROR;
+
+ERROR:
+    i2c_stop();
+
+    return err;
+}
+
+/*
+ * Read back the result of a conversion, once it has had 45ms to complete
+ */
+static uint8_t
+hp30_read_conversion(uint16_t *result)
+{
+    uint8_t err;
+
+    if ((err = i2c_start(HP30_ADDR_SENSOR, I2C_SLA_W)) != 0)
+        goto ERROR;
+    if ((err = i2c_send_byte(0xfd)) != 0)
+        goto ERROR;
+    if ((err = i2c_rep_start(HP30_ADDR_SENSOR, I2C_SLA_R)) != 0)
+        goto ERROR;
+
+    *result = i2c_read_byte_ack() << 8;
+    *result |= i2c_read_byte_nack();
+
+ERROR:
+    i2c_stop();
+
+    return err;
+}
+
+/*
+ * Calculate actual values from the raw pressure (d1) and temperature (d2)
+ */
+static void
+hp30_compensate(uint16_t d1, uint16_t d2, hp30_measure_t *values)
 {
-    uint16_t    d1;
-    uint16_t    d2;
     int32_t     t1;
     int32_t     dut;
     int32_t     off;
     int32_t     sens;
     int32_t     x;
+    int32_t     n;
+
+    dut = (int32_t)d2 - hp30_c.c5;
+    t1 = (dut * dut) >> 14;
+
+    if (dut >= 0)
+        dut -= hp30_shr(t1 * hp30_c.a, hp30_k.c_mul);
+    else
+        dut -= hp30_shr(t1 * hp30_c.b, hp30_k.c_mul);
+
+    n = hp30_k.c4m * dut;
+    off = hp30_k.c2x4 + HP30_DIV_POW2(n, 14) * 4;
+
+    n = hp30_c.c3 * dut;
+    sens = hp30_c.c1 + HP30_DIV_POW2(n, 10);
+
+    // an unsigned int on the AVR, so it wraps below 7168 (as it always has)
+    n = sens * (uint16_t)(d1 - 7168);
+    x = HP30_DIV_POW2(n, 14) - off;
+
+    n = x * 10;
+    values->pressure = HP30_DIV_POW2(n, 5) + hp30_c.c7;
 
     /*
-     * Read temperature measurement
+     * The last term is dut / 2^d.  This used to be written (1 << d), which
+     * with a 16-bit int is -32768 for d = 15, flipping the term's sign; it
+     * is now a true division by 2^d for all d from 0 to 15
      */
+    n = dut * hp30_c.c6;
+    values->temperature = 250 + HP30_DIV_POW2(n, 16)
+        - hp30_shr(dut + ((dut >> 31) & hp30_k.d_bias), hp30_k.d_mul);
+}
+
+#if AVR_FEATURE_HP30_BENCHMARK
+/*
+ * Time hp30_compensate() on the target with the calibration read by
+ * hp30_init(), over a spread of readings.  Returns the average cycles per
+ * call, to the resolution of clock_now_cycles() divided by 256.
+ */
+uint32_t
+hp30_benchmark_compensate(void)
+{
+    hp30_measure_t  values;
+    uint32_t        start   = clock_now_cycles();
+
+    for (uint16_t i = 0; i < 256; i++)
+        hp30_compensate(i * 251, hp30_c.c5 + i * 32 - 4096, &values);
+
+    return (clock_now_cycles() - start) / 256;
+}
+#endif
+
+void
+hp30_read_values(hp30_measure_t *values)
+{
+    uint16_t    d1  = 0;
+    uint16_t    d2  = 0;
+
     sbi(*xclr_port, xclr_pin);
 
-    i2c_start(HP30_ADDR_SENSOR, I2C_SLA_W);
-    i2c_send_byte(0xff);
-    i2c_send_byte(0xe8);
-    i2c_stop();
+    /*
+     * Read temperature measurement
+     */
+    hp30_start_conversion(HP30_CONVERT_TEMPERATURE);
 
     /* wait 45ms */
     for (int i = 0; i < 9; i++)
         _delay_ms(5);
 
-    i2c_start(HP30_ADDR_SENSOR, I2C_SLA_W);
-    i2c_send_byte(0xfd);
-
-    i2c_rep_start(HP30_ADDR_SENSOR, I2C_SLA_R);
-    d2 = i2c_read_byte_ack() << 8;
-    d2 |= i2c_read_byte_nack();
-    i2c_stop();
-
-    cbi(*xclr_port, xclr_pin);
+    hp30_read_conversion(&d2);
 
     /*
      * Read pressure measurement
      */
-    sbi(*xclr_port, xclr_pin);
-
-    i2c_start(HP30_ADDR_SENSOR, I2C_SLA_W);
-    i2c_send_byte(0xff);
-    i2c_send_byte(0xf0);
-    i2c_stop();
+    hp30_start_conversion(HP30_CONVERT_PRESSURE);
 
     /* wait 45ms */
     for (int i = 0; i < 9; i++)
         _delay_ms(5);
 
-    i2c_start(HP30_ADDR_SENSOR, I2C_SLA_W);
-    i2c_send_byte(0xfd);
+    hp30_read_conversion(&d1);
 
-    i2c_rep_start(HP30_ADDR_SENSOR, I2C_SLA_R);
-    d1 = i2c_read_byte_ack() << 8;
-    d1 |= i2c_read_byte_nack();
-    i2c_stop();
+    cbi(*xclr_port, xclr_pin);
+
+    hp30_compensate(d1, d2, values);
+}
+
+#if AVR_FEATURE_TASKS
+
+/*
+ * Non-blocking measurement.  Each conversion is started and then read back
+ * from a task 50ms later; the temperature readback also starts the pressure
+ * conversion.  The main loop is only held up for the I2C transfers.
+ */
+#define CONVERSION_TICKS    5       /* 50ms, in 10ms clock ticks */
+
+#define HP30_STATE_TEMPERATURE  0   /* temperature conversion in progress */
+#define HP30_STATE_PRESSURE     1   /* pressure conversion in progress */
+
+static hp30_callback_t  *measure_callback;
+static uint16_t         measure_d2;
+
+static void
+hp30_finish(uint8_t err, uint16_t d1)
+{
+    hp30_measure_t      values;
+    hp30_callback_t     *callback   = measure_callback;
 
     cbi(*xclr_port, xclr_pin);
+    measure_callback = 0;
 
-    /*
-     * Calculate actual values
-     */
+    if (err == 0)
+        hp30_compensate(d1, measure_d2, &values);
 
-    t1 = ((int32_t)d2 - hp30_c.c5);
-    t1 = (t1 * t1) >> 14;
+    (*callback)(err, &values);
+}
 
-    if ((int32_t)d2 >= hp30_c.c5)
-        dut = (int32_t)d2 - hp30_c.c5 - ((t1 * hp30_c.a) >> hp30_c.c);
-    else
-        dut = (int32_t)d2 - hp30_c.c5 - ((t1 * hp30_c.b) >> hp30_c.c);
+static uint32_t
+hp30_measure_task(uint32_t now, uint32_t *data)
+{
+    uint16_t    d1;
+    uint8_t     err;
 
-    off = (hp30_c.c2 + (((hp30_c.c4 - 1024) * dut) / 16384)) * 4;
+    switch (*data)
+    {
+    case HP30_STATE_TEMPERATURE:
+        if ((err = hp30_read_conversion(&measure_d2)) != 0)
+            break;
+        if ((err = hp30_start_conversion(HP30_CONVERT_PRESSURE)) != 0)
+            break;
+
+        *data = HP30_STATE_PRESSURE;
+
+        return now + CONVERSION_TICKS;
+
+    case HP30_STATE_PRESSURE:
+    default:
+        err = hp30_read_conversion(&d1);
+        hp30_finish(err, d1);
+
+        return 0;
+    }
+
+    hp30_finish(err, 0);
+
+    return 0;
+}
+
+/*
+ * Start a measurement.  The callback is called (from task_run_ready())
+ * about 100ms later; the values are only valid if status is 0.
+ * Returns non-zero if a measurement is already in progress or the
+ * sensor couldn't be started.
+ */
+uint8_t
+hp30_start_measurement(hp30_callback_t *callback)
+{
+    if (measure_callback)
+        return 1;
+
+    sbi(*xclr_port, xclr_pin);
 
-    sens = hp30_c.c1 + ((hp30_c.c3 * dut) / 1024);
+    if (hp30_start_conversion(HP30_CONVERT_TEMPERATURE) != 0)
+    {
+        cbi(*xclr_port, xclr_pin);
+        return 1;
+    }
 
-    x = ((sens * (d1 - 7168)) / 16384) - off;
+    measure_callback = callback;
 
-    values->pressure = ((x * 10) / 32) + hp30_c.c7;
+    if (task_submit(clock_current_time() + CONVERSION_TICKS, 0, hp30_measure_task,
+        HP30_STATE_TEMPERATURE) == TASK_INVALID)
+    {
+        measure_callback = 0;
+        cbi(*xclr_port, xclr_pin);
+        return 1;
+    }
 
-    values->temperature = 250 + ((dut * hp30_c.c6) / 65536) - (dut / (1 << hp30_c.d));
+    return 0;
 }
+#endif /* AVR_FEATURE_TASKS */
@@ -3,11 +3,60 @@
  */
 #include <avr/io.h>
 #include <util/twi.h>
+#include <util/delay.h>
 #include MCU_H
 #include "avr-common.h"
 #include "i2c.h"
 
-static uint8_t  done_init;
+#ifndef AVR_I2C_FAST_CLOCK_HZ
+# define AVR_I2C_FAST_CLOCK_HZ  400000L
+#endif
+
+#ifdef AVR_FEATURE_I2C_MAX_DEVICE_SPEEDS
+# define MAX_DEVICE_SPEEDS  AVR_FEATURE_I2C_MAX_DEVICE_SPEEDS
+#else
+# define MAX_DEVICE_SPEEDS  4
+#endif
+
+/*
+ * TWBR value for a given SCL frequency, with the prescaler set to 1. If the
+ * CPU clock is too slow for the requested speed we run as fast as we can.
+ */
+#define I2C_TWBR(HZ) \
+    ((F_CPU / (long)(HZ)) > 16 ? ((F_CPU / (long)(HZ)) - 16) / 2 : 0)
+
+static const uint8_t    speed_twbr[] =
+{
+    [I2C_SPEED_STANDARD]    = I2C_TWBR(AVR_I2C_CLOCK_HZ),
+    [I2C_SPEED_FAST]        = I2C_TWBR(AVR_I2C_FAST_CLOCK_HZ),
+};
+
+/*
+ * Devices that don't run at the standard speed. Anything not listed here
+ * is driven at AVR_I2C_CLOCK_HZ.
+ */
+typedef struct
+{
+    uint8_t     address;
+    uint8_t     speed;
+}
+    device_speed_t;
+
+static device_speed_t   device_speeds[MAX_DEVICE_SPEEDS];
+static uint8_t          n_device_speeds;
+
+/*
+ * Maximum time to wait for the TWI hardware before giving up on the bus
+ */
+#ifdef AVR_FEATURE_I2C_TIMEOUT_US
+# define I2C_TIMEOUT_US     AVR_FEATURE_I2C_TIMEOUT_US
+#else
+# define I2C_TIMEOUT_US     2000
+#endif
+
+static uint8_t      done_init;
+static uint8_t      bus_failed;     // error code from a timeout, until the next START
+static i2c_stats_t  stats;
 
 void
 i2c_init(void)
@@ -23,13 +72,68 @@ i2c_init(void)
         // set prescaler to 1
         TWSR = 0;
 
-        // set clock to 100kHz
-        TWBR = ((F_CPU / (long)AVR_I2C_CLOCK_HZ) - 16) / 2;
+        // set clock to the standard speed
+        TWBR = speed_twbr[I2C_SPEED_STANDARD];
 
         done_init = 1;
     }
 }
 
+/*
+ * Define the bus speed to use for a given device.  Returns non-zero if the
+ * table is full.
+ */
+uint8_t
+i2c_set_device_speed(uint8_t address, uint8_t speed)
+{
+    uint8_t i;
+
+    address &= 0x7f;
+
+    for (i = 0; i < n_device_speeds; i++)
+    {
+        if (device_speeds[i].address == address)
+            break;
+    }
+
+    if (i == n_device_speeds)
+    {
+        if (speed == I2C_SPEED_STANDARD)
+            return 0;
+
+        if (n_device_speeds == MAX_DEVICE_SPEEDS)
+            return 1;
+
+        n_device_speeds++;
+    }
+
+    device_speeds[i].address = address;
+    device_speeds[i].speed = speed;
+
+    return 0;
+}
+
+/*
+ * Switch the bus clock to the speed profile of the given device
+ */
+static void
+i2c_select_speed(uint8_t address)
+{
+    uint8_t speed   = I2C_SPEED_STANDARD;
+
+    for (uint8_t i = 0; i < n_device_speeds; i++)
+    {
+        if (device_speeds[i].address == address)
+        {
+            speed = device_speeds[i].speed;
+            break;
+        }
+    }
+
+    if (TWBR != speed_twbr[speed])
+        TWBR = speed_twbr[speed];
+}
+
 void
 i2c_slave_init(uint8_t address)
 {
@@ -44,8 +148,8 @@ i2c_slave_init(uint8_t address)
         // set prescaler to 1
         TWSR = 0;
 
-        // set clock to 100kHz
-        TWBR = ((F_CPU / (long)AVR_I2C_CLOCK_HZ) - 16) / 2;
+        // set clock to the standard speed
+        TWBR = speed_twbr[I2C_SPEED_STANDARD];
 
         // set our address (ignore general call)
         TWAR = address << 1;
@@ -57,35 +161,238 @@ i2c_slave_init(uint8_t address)
     }
 }
 
+/*
+ * Slave mode register map.
+ *
+ * A master write sets the register pointer with its first data byte; any
+ * further bytes are stored at the pointer, which auto-increments (and wraps
+ * at the end of the map).  A master read returns bytes starting at the
+ * current pointer, so a master can fetch the whole map in one burst with
+ * a write of the start register followed by a repeated START and a read.
+ * Registers at or above "writable" are read-only.
+ */
+static volatile uint8_t             *slave_regs;
+static uint8_t                      slave_size;
+static uint8_t                      slave_writable;
+static i2c_slave_write_handler_t    *slave_write_fn;
+static i2c_slave_read_handler_t     *slave_read_fn;
+
+static volatile uint8_t             slave_ptr;
+static volatile uint8_t             slave_got_ptr;
+
+void
+i2c_slave_set_register_map(volatile uint8_t *regs, uint8_t size,
+    uint8_t writable, i2c_slave_write_handler_t *write_fn,
+    i2c_slave_read_handler_t *read_fn)
+{
+    slave_regs = regs;
+    slave_size = size;
+    slave_writable = writable;
+    slave_write_fn = write_fn;
+    slave_read_fn = read_fn;
+
+    slave_ptr = 0;
+    slave_got_ptr = 0;
+}
+
+static void
+i2c_slave_next_ptr(void)
+{
+    if (++slave_ptr >= slave_size)
+        slave_ptr = 0;
+}
+
+/*
+ * Handle a TWI event in slave mode.  This should be called from the
+ * TWI_vect interrupt handler.
+ */
+void
+i2c_slave_intr_handler(void)
+{
+    switch (TWSR & 0xf8)
+    {
+    case TW_SR_SLA_ACK:
+    case TW_SR_ARB_LOST_SLA_ACK:
+        // addressed for writing: the first byte is the register pointer
+        slave_got_ptr = 0;
+        break;
+
+    case TW_SR_DATA_ACK:
+        if (!slave_got_ptr)
+        {
+            slave_ptr = TWDR;
+            if (slave_ptr >= slave_size)
+                slave_ptr = 0;
+
+            slave_got_ptr = 1;
+        }
+        else
+        {
+            uint8_t reg     = slave_ptr;
+            uint8_t value   = TWDR;
+
+            if (reg < slave_writable)
+            {
+                slave_regs[reg] = value;
+
+                if (slave_write_fn)
+                    (*slave_write_fn)(reg, value);
+            }
+
+            i2c_slave_next_ptr();
+        }
+        break;
+
+    case TW_ST_SLA_ACK:
+    case TW_ST_ARB_LOST_SLA_ACK:
+    case TW_ST_DATA_ACK:
+        // addressed for reading, or the master wants another byte
+        if (slave_size == 0)
+        {
+            TWDR = 0xff;
+            break;
+        }
+
+        if (slave_read_fn)
+            (*slave_read_fn)(slave_ptr);
+
+        TWDR = slave_regs[slave_ptr];
+        i2c_slave_next_ptr();
+        break;
+
+    case TW_BUS_ERROR:
+        // release the bus
+        TWCR = (1<<TWINT) | (1<<TWSTO) | (1<<TWEN) | (1<<TWEA) | (1<<TWIE);
+        return;
+
+    default:
+        // end of transfer (STOP, NACK, last byte): go back to listening
+        break;
+    }
+
+    TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA) | (1<<TWIE);
+}
+
+#define SDA_IS_HIGH()   (AVR_I2C_PIN & (1 << AVR_I2C_PORT_SDA))
+
+/*
+ * Free a bus that is stuck with SDA held low by a slave: clock SCL until
+ * the slave lets go of SDA (at most 9 pulses), then send a STOP.  The
+ * lines are driven open-drain as GPIOs while the TWI is disabled.
+ * Returns non-zero if SDA is still held low.
+ */
+static uint8_t
+i2c_recover_bus(void)
+{
+    uint8_t err = 0;
+
+    TWCR = 0;
+
+    cbi(AVR_I2C_PORT, AVR_I2C_PORT_SCL);
+    cbi(AVR_I2C_PORT, AVR_I2C_PORT_SDA);
+    cbi(AVR_I2C_DDR, AVR_I2C_PORT_SDA);
+    cbi(AVR_I2C_DDR, AVR_I2C_PORT_SCL);
+    _delay_us(5);
+
+    for (uint8_t i = 0; i < 9 && !SDA_IS_HIGH(); i++)
+    {
+        sbi(AVR_I2C_DDR, AVR_I2C_PORT_SCL);     // SCL low
+        _delay_us(5);
+        cbi(AVR_I2C_DDR, AVR_I2C_PORT_SCL);     // SCL high
+        _delay_us(5);
+    }
+
+    if (!SDA_IS_HIGH())
+    {
+        stats.failed_recoveries++;
+        err = 1;
+        goto DONE;
+    }
+
+    // STOP: SDA low -> high while SCL is high
+    sbi(AVR_I2C_DDR, AVR_I2C_PORT_SCL);
+    sbi(AVR_I2C_DDR, AVR_I2C_PORT_SDA);
+    _delay_us(5);
+    cbi(AVR_I2C_DDR, AVR_I2C_PORT_SCL);
+    _delay_us(5);
+    cbi(AVR_I2C_DDR, AVR_I2C_PORT_SDA);
+    _delay_us(5);
+
+DONE:
+    // hand the pins back to the TWI
+    sbi(AVR_I2C_DDR, AVR_I2C_PORT_SCL);
+    sbi(AVR_I2C_DDR, AVR_I2C_PORT_SDA);
+
+    TWCR = (1<<TWEN);
+
+    stats.recoveries++;
+
+    return err;
+}
+
+/*
+ * Wait for the current TWI operation to complete.  Returns non-zero (after
+ * recovering the bus) if it doesn't complete within I2C_TIMEOUT_US.
+ */
+static uint8_t
+i2c_wait(void)
+{
+    for (uint16_t n = I2C_TIMEOUT_US; n > 0; n--)
+    {
+        if (TWCR & (1<<TWINT))
+            return 0;
+
+        _delay_us(1);
+    }
+
+    stats.timeouts++;
+
+    bus_failed = i2c_recover_bus() ? I2C_ERR_BUS_STUCK : I2C_ERR_TIMEOUT;
+
+    return bus_failed;
+}
+
 uint8_t
 i2c_start(uint8_t address, uint8_t mode)
 {
     uint8_t s;
 
+    address &= 0x7f;
+
+    i2c_select_speed(address);
+
+    bus_failed = 0;
+
     // send START condition
     TWCR = (1<<TWINT) | (1<<TWSTA) | (1<<TWEN);
 
     // wait for transmission to complete
-    while (!(TWCR & (1<<TWINT)))
-        continue;
+    if (i2c_wait())
+        return bus_failed;
 
     // check for error
     s = TWSR & 0xf8;
     if (s != TW_START && s != TW_REP_START)
+    {
+        stats.errors++;
         return 1;
+    }
 
     // send device address
-    TWDR = ((address & 0x7f) << 1) | mode;
+    TWDR = (address << 1) | mode;
     TWCR = (1<<TWINT) | (1<<TWEN);
 
     // wait for transmission to complete
-    while (!(TWCR & (1<<TWINT)))
-        continue;
+    if (i2c_wait())
+        return bus_failed;
 
     // check for error
     s = TWSR & 0xf8;
     if (s != TW_MT_SLA_ACK && s != TW_MR_SLA_ACK)
+    {
+        stats.errors++;
         return 2;
+    }
 
     return 0;
 }
@@ -99,17 +406,23 @@ i2c_rep_start(uint8_t address, uint8_t mode)
 uint8_t
 i2c_send_byte(uint8_t data)
 {
+    if (bus_failed)
+        return bus_failed;
+
     // send data
     TWDR = data;
     TWCR = (1<<TWINT) | (1<<TWEN);
 
     // wait for transmission to complete
-    while (!(TWCR & (1<<TWINT)))
-        continue;
+    if (i2c_wait())
+        return bus_failed;
 
     // check for error
     if ((TWSR & 0xf8) != TW_MT_DATA_ACK)
+    {
+        stats.errors++;
         return 1;
+    }
 
     return 0;
 }
@@ -143,15 +456,22 @@ i2c_status(void)
     return TWSR & 0xf8;
 }
 
+/*
+ * The read functions return 0xff if the bus has failed; i2c_bus_failed()
+ * can be used to tell this apart from real data.
+ */
 uint8_t
 i2c_read_byte_ack(void)
 {
+    if (bus_failed)
+        return 0xff;
+
     // initialise receipt
     TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWEA);
 
     // wait for receipt to complete
-    while (!(TWCR & (1<<TWINT)))
-        continue;
+    if (i2c_wait())
+        return 0xff;
 
     return TWDR;
 }
@@ -159,12 +479,15 @@ i2c_read_byte_ack(void)
 uint8_t
 i2c_read_byte_nack(void)
 {
+    if (bus_failed)
+        return 0xff;
+
     // initialise receipt
     TWCR = (1<<TWINT) | (1<<TWEN);
 
     // wait for receipt to complete
-    while (!(TWCR & (1<<TWINT)))
-        continue;
+    if (i2c_wait())
+        return 0xff;
 
     return TWDR;
 }
@@ -172,12 +495,41 @@ i2c_read_byte_nack(void)
 void
 i2c_stop(void)
 {
+    // the bus has already been released by i2c_recover_bus()
+    if (bus_failed)
+        return;
+
     // send STOP condition
     TWCR = (1<<TWINT) | (1<<TWEN) | (1<<TWSTO);
 
-    // wait for transmission to complete and bus to be released
-    while (!(TWCR & (1<<TWSTO)))
-        continue;
+    // wait for the STOP to be sent and the bus to be released
+    for (uint16_t n = I2C_TIMEOUT_US; (TWCR & (1<<TWSTO)) != 0; n--)
+    {
+        if (n == 0)
+        {
+            stats.timeouts++;
+            bus_failed = i2c_recover_bus() ? I2C_ERR_BUS_STUCK : I2C_ERR_TIMEOUT;
+            break;
+        }
+
+        _delay_us(1);
+    }
 
     return;
 }
+
+/*
+ * Returns I2C_ERR_TIMEOUT or I2C_ERR_BUS_STUCK if an operation has timed
+ * out since the last START, or 0
+ */
+uint8_t
+i2c_bus_failed(void)
+{
+    return bus_failed;
+}
+
+void
+i2c_get_stats(i2c_stats_t *s)
+{
+    *s = stats;
+}
@@ -7,6 +7,10 @@
 #include "i2c.h"
 #include "lcd2s.h"
 
+#if AVR_FEATURE_LCD2S_BENCHMARK
+#include "clock.h"
+#endif
+
 static uint8_t i2c_address;
 
 static uint8_t
@@ -262,3 +266,41 @@ lcd_load_character(uint8_t id, const uint8_t *data)
 
     return lcd_send_command_varg(LCD_CMD_LOAD_CHARACTER, 9, vec);
 }
+
+#if AVR_FEATURE_LCD2S_BENCHMARK
+/*
+ * Time a full refresh of a 4x20 display at each I2C speed profile, to see
+ * what Fast-mode is worth.  The times are in microseconds, from
+ * clock_now_us(), so the clock must be running.  The display is left on
+ * the fast profile.  Returns non-zero if a write failed.
+ */
+uint8_t
+lcd_benchmark_refresh(uint32_t *standard_us, uint32_t *fast_us)
+{
+    static const char   line[] = "0123456789ABCDEFGHIJ";
+    uint32_t            *result[2];
+
+    result[I2C_SPEED_STANDARD] = standard_us;
+    result[I2C_SPEED_FAST] = fast_us;
+
+    for (uint8_t speed = I2C_SPEED_STANDARD; speed <= I2C_SPEED_FAST; speed++)
+    {
+        uint32_t    start;
+
+        if (i2c_set_device_speed(i2c_address, speed) != 0)
+            return 1;
+
+        start = clock_now_us();
+
+        for (uint8_t row = 1; row <= 4; row++)
+        {
+            if (lcd_goto_position(row, 1) != 0 || lcd_write_parsed_string(line) != 0)
+                return 1;
+        }
+
+        *result[speed] = clock_elapsed_us(start);
+    }
+
+    return 0;
+}
+#endif /* AVR_FEATURE_LCD2S_BENCHMARK */
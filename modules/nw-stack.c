@@ -6,6 +6,7 @@
 #include "avr-common.h"
 #include "clock.h"
 #include "task.h"
+#include "timer-wheel.h"
 #include "enc28j60.h"
 
 #include "nw-stack.h"
@@ -22,6 +23,10 @@
 #define AVR_FEATURE_NWSTACK_ARP_CACHE_SIZE          3
 #endif
 
+#ifndef AVR_FEATURE_NWSTACK_NTP_SERVERS
+#define AVR_FEATURE_NWSTACK_NTP_SERVERS             3
+#endif
+
 /*
  * The packet buffer
  */
@@ -274,6 +279,34 @@ arp_cache_lookup(uint8_t *ip)
     return 0;   /* no entry in the ARP cache */
 }
 
+/*
+ * Is there an ARP request outstanding for the given IP address?
+ */
+static uint8_t
+arp_cache_pending(uint8_t *ip)
+{
+    for (uint8_t i = 0; i < AVR_FEATURE_NWSTACK_ARP_CACHE_SIZE; i++)
+    {
+        if
+        (
+            arp_cache[i].alloc
+            &&
+            !arp_cache[i].valid
+            &&
+            arp_cache[i].ip_address[0] == ip[0]
+            &&
+            arp_cache[i].ip_address[1] == ip[1]
+            &&
+            arp_cache[i].ip_address[2] == ip[2]
+            &&
+            arp_cache[i].ip_address[3] == ip[3]
+        )
+            return 1;
+    }
+
+    return 0;
+}
+
 /*
  * Get a free cache slot, re-using the LRU entry if necessary
  */
@@ -444,15 +477,18 @@ send_arp_request(uint8_t *req_ip_address)
     enc28j60_send_packet(eth, len);
 
     /*
-     * Add a pending cache entry
+     * Add a pending cache entry, unless this is a retry
      */
-    uint8_t slot    = arp_get_cache_slot();
+    if (!arp_cache_pending(req_ip_address))
+    {
+        uint8_t slot    = arp_get_cache_slot();
 
-    for (uint8_t i = 0; i < 4; i++)
-        arp_cache[slot].ip_address[i] = req_ip_address[i];
+        for (uint8_t i = 0; i < 4; i++)
+            arp_cache[slot].ip_address[i] = req_ip_address[i];
+
+        arp_cache[slot].alloc = 1;
+    }
 
-    arp_cache[slot].alloc = 1;
-     
     sei();
 }
 
@@ -525,8 +561,13 @@ udp_process_packet(uint8_t *eth, uint8_t *ip, uint8_t *data, unsigned int left)
     data += consumed;
     left -= consumed;
 
+    if (UDP_GET_SRC_PORT(udp) == UDP_PORT_NTP)
+        ntp_process_packet(eth, ip, udp, data, left);
+#if AVR_FEATURE_NWSTACK_NTP_SERVER
+    else
     if (UDP_GET_DST_PORT(udp) == UDP_PORT_NTP)
         ntp_process_packet(eth, ip, udp, data, left);
+#endif
 
     return;
 }
@@ -555,29 +596,43 @@ typedef struct {
     uint16_t        remote_port;
     uint8_t         state;
     uint32_t        seqno;
-    unsigned long   msl2;
+    timer_wheel_entry_t timer;
 } tcb_t;
 
+#define TCP_TIMEWAIT_TICKS      (30 * 100)      // 2MSL: 30 seconds
+
 /*
  * TCP Control Block.
  * Entries are initialised with .state == 0 == TCP_STATE_LISTEN by default.
  */
 static tcb_t    tcb[AVR_FEATURE_NWSTACK_MAX_TCP_CONNECTIONS];
 
+/*
+ * TIME_WAIT connections are closed by a timer on the timer wheel, so this
+ * only has to run the wheel (as network_read_packet() also does)
+ */
 void
 tcp_expire_connections(void)
 {
-    uint32_t    clock   = clock_current_time();
+    timer_wheel_run(clock_current_time());
+}
 
-    // close any TCP sockets in TIME_WAIT state
-    for (int n = 0; n < AVR_FEATURE_NWSTACK_MAX_TCP_CONNECTIONS; n++)
-    {
-        // XXX: need to cater for wraparound!
-        if (tcb[n].state == TCP_STATE_TIMEWAIT && clock >= tcb[n].msl2)
-        {
-            tcb[n].state = TCP_STATE_LISTEN;
-        }
-    }
+static void
+tcp_timewait_expired(uint32_t now, uint32_t n)
+{
+    tcb[n].state = TCP_STATE_LISTEN;
+}
+
+/*
+ * Enter TIME_WAIT, or restart the 2MSL timer if already there
+ */
+static void
+tcp_enter_timewait(uint8_t n)
+{
+    tcb[n].state = TCP_STATE_TIMEWAIT;
+
+    timer_wheel_start(&tcb[n].timer, clock_current_time() + TCP_TIMEWAIT_TICKS,
+        tcp_timewait_expired, n);
 }
 
 static void
@@ -697,7 +752,7 @@ tcp_process_packet(uint8_t *eth, uint8_t *ip, uint8_t *data, unsigned int left)
             tcb[n].remote_ip[2] = ip[IP_SRC_IP_OFFSET+2];
             tcb[n].remote_ip[3] = ip[IP_SRC_IP_OFFSET+3];
             tcb[n].seqno = clock_current_time();
-            tcb[n].msl2 = 0;
+            timer_wheel_cancel(&tcb[n].timer);
         }
 
         if (tcb[n].state == TCP_STATE_LISTEN)
@@ -768,7 +823,7 @@ tcp_process_packet(uint8_t *eth, uint8_t *ip, uint8_t *data, unsigned int left)
                     tcb[n].seqno,
                     0);
 
-                tcb[n].state = TCP_STATE_TIMEWAIT;
+                tcp_enter_timewait(n);
             }
             else
             if (TCP_GET_FLAGS(tcp) == TCP_FLAG_ACK)
@@ -792,20 +847,20 @@ tcp_process_packet(uint8_t *eth, uint8_t *ip, uint8_t *data, unsigned int left)
                 send_reply(eth, ip, tcp, TCP_FLAG_ACK,
                     TCP_GET_SEQNO(tcp) + 1,         // received FIN
                     tcb[n].seqno, 0);
-                tcb[n].state = TCP_STATE_TIMEWAIT;
+                tcp_enter_timewait(n);
             }
         }
         else
         if (tcb[n].state == TCP_STATE_CLOSING)
         {
             if (TCP_GET_FLAGS(tcp) == TCP_FLAG_ACK)
-                tcb[n].state = TCP_STATE_TIMEWAIT;
+                tcp_enter_timewait(n);
         }
         else
         if (tcb[n].state == TCP_STATE_TIMEWAIT)
         {
-            // XXX: set timeout
-            tcb[n].msl2 = clock_current_time() + 30 * 100;     // 30 seconds
+            // the other end is still sending, so wait longer
+            tcp_enter_timewait(n);
         }
         else
         if (tcb[n].state == TCP_STATE_LASTACK)
@@ -903,50 +958,437 @@ network_send_http_request(uint8_t *dest_ip_address, char *message, char *userage
 
 #include "ntp.h"
 
-uint8_t ntp_request_ip[4];
+/*
+ * NTP requests go to up to NTP_SERVERS servers at a time, each from its own
+ * random source port.  The requests sent together make up a round, which
+ * ends when every server has answered, or after NTP_ROUND_TICKS.  The reply
+ * with the shortest round trip is then used: its timestamps have the least
+ * room for error from queuing on the way.
+ */
+#define NTP_SERVERS         AVR_FEATURE_NWSTACK_NTP_SERVERS
+#define NTP_ROUND_TICKS     200     /* wait up to 2s for replies */
+#define NTP_POLL_TICKS      10      /* check for ARP replies every 100ms */
+#define NTP_ARP_RETRY_TICKS 50      /* resend ARP requests every 500ms */
+#define NTP_MAX_DELAY       65536L  /* ignore replies taking over 1s */
+
+#define NTP_SLOT_FREE       0
+#define NTP_SLOT_ARP        1       /* waiting for the server's MAC address */
+#define NTP_SLOT_SENT       2
+#define NTP_SLOT_DONE       3
+
+typedef struct
+{
+    uint8_t         state;
+    uint8_t         ip[4];
+    uint16_t        port;           // our source port
+    uint32_t        t1_secs;        // our transmit timestamp
+    uint32_t        t1_frac;
+    uint32_t        t3_secs;        // server's transmit timestamp
+    uint32_t        t3_frac;
+    uint8_t         step;           // too far out to slew
+    ntp_sample_t    sample;
+}
+    ntp_request_t;
+
+static ntp_request_t    ntp_requests[NTP_SERVERS];
+static uint8_t          ntp_round_active;
+static timer_wheel_entry_t  ntp_round_timer;
+static timer_wheel_entry_t  ntp_arp_timer;
+static uint32_t         ntp_round_end;
+static uint16_t         ntp_port_seed;
+
+static ntp_sample_t     ntp_last_sample;
+
+#if AVR_FEATURE_NWSTACK_NTP_SERVER
+static uint32_t         ntp_ref_secs;       // when the clock was last set by NTP
+static uint32_t         ntp_ref_frac;
+#endif
+
+/*
+ * Middle 32 bits of an NTP timestamp, i.e. 16.16 fixed point seconds.  This
+ * wraps every 18 hours, which doesn't matter for differences.
+ */
+#define NTP_SHORT(S, F)     (((S) << 16) | ((F) >> 16))
+
+/*
+ * Timestamp for our end of the exchange.  Without a wall clock the tick
+ * count is used: the offset is then meaningless, but the round trip delay
+ * is still measured.
+ */
+static void
+ntp_local_time(uint32_t *secs, uint32_t *frac)
+{
+#if AVR_FEATURE_CLOCK_WALL_TIME
+    clock_get_ntp_time(secs, frac);
+#else
+    uint32_t    now = clock_current_time();
+
+    *secs = now / CLOCK_TICKS_PER_SEC;
+    *frac = (now % CLOCK_TICKS_PER_SEC) * (0xffffffffUL / CLOCK_TICKS_PER_SEC + 1);
+#endif
+}
+
+/*
+ * Pick an ephemeral port (49152-65535) not used by another request.  A
+ * xorshift generator is stirred with the timer count, which depends on
+ * when packets happened to arrive.
+ */
+static uint16_t
+ntp_random_port(void)
+{
+    uint16_t    port;
+    uint8_t     used;
+
+    do
+    {
+        uint16_t    x   = ntp_port_seed ^ TCNT1 ^ (uint16_t)clock_current_time();
+
+        x ^= x << 7;
+        x ^= x >> 9;
+        x ^= x << 8;
+        ntp_port_seed = x;
+
+        port = 0xc000 | (x & 0x3fff);
+
+        used = 0;
+        for (uint8_t i = 0; i < NTP_SERVERS; i++)
+        {
+            if (ntp_requests[i].state != NTP_SLOT_FREE && ntp_requests[i].port == port)
+                used = 1;
+        }
+    }
+    while (used);
+
+    return port;
+}
+
+/*
+ * Work out the clock offset and round trip delay from the four timestamps:
+ *
+ *      T1  request sent (our clock)        T2  request received (server)
+ *      T4  reply received (our clock)      T3  reply sent (server)
+ *
+ *      offset = ((T2 - T1) + (T3 - T4)) / 2
+ *      delay  = (T4 - T1) - (T3 - T2)
+ */
+static void
+ntp_take_sample(ntp_request_t *r, uint8_t *ntp, uint32_t t4_secs, uint32_t t4_frac)
+{
+    uint32_t    t1      = NTP_SHORT(r->t1_secs, r->t1_frac);
+    uint32_t    t2      = NTP_SHORT(NTP_GET_RECEIVE_SECS(ntp), NTP_GET_RECEIVE_FRACT(ntp));
+    uint32_t    t3;
+    uint32_t    t4      = NTP_SHORT(t4_secs, t4_frac);
+    int32_t     dsecs;
+    int32_t     offset;
+    int32_t     delay;
+
+    r->t3_secs = NTP_GET_TRANSMIT_SECS(ntp);
+    r->t3_frac = NTP_GET_TRANSMIT_FRACT(ntp);
+
+    t3 = NTP_SHORT(r->t3_secs, r->t3_frac);
+    dsecs = (int32_t)(r->t3_secs - t4_secs);
+    offset = ((int32_t)(t2 - t1) >> 1) + ((int32_t)(t3 - t4) >> 1);
+    delay = (int32_t)(t4 - t1) - (int32_t)(t3 - t2);
+
+    // the server's clock can be finer than ours
+    if (delay < 0)
+        delay = 0;
+
+    r->sample.offset = offset;
+    r->sample.delay = delay;
+    r->sample.stratum = NTP_GET_STRATUM(ntp);
+    r->sample.time = clock_current_time();
+    r->sample.root_delay = NTP_GET_ROOTDELAY(ntp);
+    r->sample.root_disp = NTP_GET_ROOTDISP(ntp);
+    for (uint8_t i = 0; i < 4; i++)
+        r->sample.server[i] = r->ip[i];
+    r->step = dsecs < -1 || dsecs > 1 || offset < -65536L || offset > 65536L;
+    r->state = NTP_SLOT_DONE;
+}
+
+/*
+ * Work out the time a reply indicates, as Unix seconds and clock ticks:
+ * the server's transmit time, plus half the round trip, plus the time
+ * since the reply arrived
+ */
+static void
+ntp_reply_time(ntp_request_t *r, uint32_t *secs, uint8_t *ticks)
+{
+    uint32_t    frac    = (r->t3_frac >> 16) + ((uint32_t)r->sample.delay >> 1);
+    uint32_t    t;
+
+    t = ((frac & 0xffff) * CLOCK_TICKS_PER_SEC >> 16) + (clock_current_time() - r->sample.time);
+
+    *secs = r->t3_secs - UNIX_EPOCH_OFFSET + (frac >> 16) + t / CLOCK_TICKS_PER_SEC;
+    *ticks = t % CLOCK_TICKS_PER_SEC;
+}
+
+/*
+ * End the round: use the reply with the shortest round trip, if there was
+ * one, and free the request slots
+ */
+static void
+ntp_finish_round(void)
+{
+    ntp_request_t   *best   = 0;
+
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
+    {
+        ntp_request_t   *r  = &ntp_requests[i];
+
+        if
+        (
+            r->state == NTP_SLOT_DONE
+            &&
+            r->sample.delay <= NTP_MAX_DELAY
+            &&
+            (!best || r->sample.delay < best->sample.delay)
+        )
+            best = r;
+    }
+
+    if (best)
+    {
+        uint32_t    secs;
+        uint8_t     ticks;
+
+        ntp_last_sample = best->sample;
+        ntp_reply_time(best, &secs, &ticks);
+
+#if AVR_FEATURE_CLOCK_WALL_TIME
+        /*
+         * Small offsets are slewed out; if the clock hasn't been set, or is
+         * out by more than a second, it is stepped
+         */
+        if (!clock_wall_time_valid() || best->step)
+            clock_sync_wall_time(secs, ticks);
+        else
+            clock_slew(best->sample.offset);
+#endif
+
+#if AVR_FEATURE_NWSTACK_NTP_SERVER
+        ntp_local_time(&ntp_ref_secs, &ntp_ref_frac);
+#endif
+
+        if (ntp_reply_handler)
+            (*ntp_reply_handler)(secs + UNIX_EPOCH_OFFSET);
+    }
+
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
+        ntp_requests[i].state = NTP_SLOT_FREE;
+
+    timer_wheel_cancel(&ntp_round_timer);
+    timer_wheel_cancel(&ntp_arp_timer);
+    ntp_round_active = 0;
+}
+
+static uint8_t
+ntp_round_pending(void)
+{
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
+    {
+        if (ntp_requests[i].state == NTP_SLOT_ARP || ntp_requests[i].state == NTP_SLOT_SENT)
+            return 1;
+    }
+
+    return 0;
+}
+
+#if AVR_FEATURE_NWSTACK_NTP_SERVER
+#if !AVR_FEATURE_CLOCK_WALL_TIME
+#error "AVR_FEATURE_NWSTACK_NTP_SERVER requires AVR_FEATURE_CLOCK_WALL_TIME"
+#endif
+
+/*
+ * SNTP server: answer client requests from the wall clock, so that one
+ * node can keep the others on the LAN in time without them all going to
+ * an upstream server.
+ *
+ * If the clock was last set by NTP we are one stratum below the server
+ * used, with its address as the reference ID, and add our delay to it to
+ * the root delay.  If it has only been set some other way (e.g. from the
+ * RTC) we claim NTP_LOCAL_STRATUM with a reference ID of "LOCL".  Until
+ * the clock is set, requests aren't answered.
+ */
+#define NTP_LOCAL_STRATUM   10
+#define NTP_MAX_STRATUM     15
+#define NTP_PRECISION       -7                          /* 2^-7s ~ one tick */
+#define NTP_TICK_SHORT      (65536L / CLOCK_TICKS_PER_SEC)  /* one tick, 16.16 */
+#define NTP_REFID_LOCL      0x4c4f434cUL                /* "LOCL" */
+
+static void
+ntp_serve_request(uint8_t *eth, uint8_t *ip, uint8_t *udp, uint8_t *ntp,
+    uint32_t rx_secs, uint32_t rx_frac)
+{
+    uint8_t     version     = (NTP_GET_LIVNMODE(ntp) >> 3) & 0x07;
+    uint8_t     stratum;
+    uint32_t    refid;
+    uint32_t    root_delay;
+    uint32_t    root_disp;
+    uint32_t    ref_secs;
+    uint32_t    ref_frac;
+    uint32_t    x;
+
+    if (!clock_wall_time_valid())
+        return;
+
+    if
+    (
+        ip[IP_DST_IP_OFFSET+0] != ip_address[0]
+        ||
+        ip[IP_DST_IP_OFFSET+1] != ip_address[1]
+        ||
+        ip[IP_DST_IP_OFFSET+2] != ip_address[2]
+        ||
+        ip[IP_DST_IP_OFFSET+3] != ip_address[3]
+    )
+        return;
+
+    if (ntp_last_sample.stratum)
+    {
+        stratum = ntp_last_sample.stratum + 1;
+        refid
+            = ((uint32_t)ntp_last_sample.server[0] << 24)
+            + ((uint32_t)ntp_last_sample.server[1] << 16)
+            + ((uint32_t)ntp_last_sample.server[2] <<  8)
+            + ((uint32_t)ntp_last_sample.server[3]);
+        root_delay = ntp_last_sample.root_delay + ntp_last_sample.delay;
+        root_disp = ntp_last_sample.root_disp + NTP_TICK_SHORT;
+        ref_secs = ntp_ref_secs;
+        ref_frac = ntp_ref_frac;
+    }
+    else
+    {
+        clock_wall_stats_t  stats;
+
+        stratum = NTP_LOCAL_STRATUM;
+        refid = NTP_REFID_LOCL;
+        root_delay = 0;
+        root_disp = NTP_TICK_SHORT;
+
+        // when the local clock was last set, e.g. from the RTC
+        clock_get_wall_stats(&stats);
+        ref_secs = stats.set_secs + UNIX_EPOCH_OFFSET;
+        ref_frac = stats.set_ticks * (0xffffffffUL / CLOCK_TICKS_PER_SEC + 1);
+    }
+
+    if (stratum > NTP_MAX_STRATUM)
+        return;
+
+    /*
+     * Rewrite the request as the reply, leaving the version and poll
+     * interval as the client sent them
+     */
+    x = NTP_GET_TRANSMIT_SECS(ntp);
+    NTP_SET_ORIGINATE_SECS(ntp, x);
+    x = NTP_GET_TRANSMIT_FRACT(ntp);
+    NTP_SET_ORIGINATE_FRACT(ntp, x);
+
+    NTP_SET_LIVNMODE(ntp, (version << 3) + 4);
+    NTP_SET_STRATUM(ntp, stratum);
+    NTP_SET_PRECISION(ntp, (uint8_t)NTP_PRECISION);
+    NTP_SET_ROOTDELAY(ntp, root_delay);
+    NTP_SET_ROOTDISP(ntp, root_disp);
+    NTP_SET_REFID(ntp, refid);
+    NTP_SET_REFERENCE_SECS(ntp, ref_secs);
+    NTP_SET_REFERENCE_FRACT(ntp, ref_frac);
+    NTP_SET_RECEIVE_SECS(ntp, rx_secs);
+    NTP_SET_RECEIVE_FRACT(ntp, rx_frac);
+
+    eth_make_reply(eth);
+    ip_make_reply(ip);
+
+    // drop any extension fields
+    IP_SET_LENGTH(ip, (udp - ip) + UDP_HEADER_LEN + NTP_HEADER_LEN);
+    ip_make_checksum(ip);
+
+    UDP_SET_DST_PORT(udp, UDP_GET_SRC_PORT(udp));
+    UDP_SET_SRC_PORT(udp, UDP_PORT_NTP);
+    UDP_SET_LENGTH(udp, UDP_HEADER_LEN + NTP_HEADER_LEN);
+
+    // take the transmit timestamp as late as possible
+    ntp_local_time(&rx_secs, &rx_frac);
+    NTP_SET_TRANSMIT_SECS(ntp, rx_secs);
+    NTP_SET_TRANSMIT_FRACT(ntp, rx_frac);
+
+    tcpudp_make_checksum(ip, udp, UDP_HEADER_LEN + NTP_HEADER_LEN, 0);
+
+    enc28j60_send_packet(eth, (ntp - eth) + NTP_HEADER_LEN);
+}
+#endif /* AVR_FEATURE_NWSTACK_NTP_SERVER */
 
 static void
 ntp_process_packet(uint8_t *eth, uint8_t *ip, uint8_t *udp, uint8_t *data, unsigned int left)
 {
+    uint32_t        t4_secs;
+    uint32_t        t4_frac;
+
+    // timestamp the reply as soon as possible
+    ntp_local_time(&t4_secs, &t4_frac);
+
     if (left < NTP_HEADER_LEN)
         return;
 
     uint8_t         *ntp        = data;
 
+#if AVR_FEATURE_NWSTACK_NTP_SERVER
+    if ((NTP_GET_LIVNMODE(ntp) & 0x07) == 3 && UDP_GET_DST_PORT(udp) == UDP_PORT_NTP)
+    {
+        ntp_serve_request(eth, ip, udp, ntp, t4_secs, t4_frac);
+        return;
+    }
+#endif
+
     if
     (
-        ntp_reply_handler != 0
-        &&
-        ip[IP_SRC_IP_OFFSET+0] == ntp_request_ip[0]
-        &&
-        ip[IP_SRC_IP_OFFSET+1] == ntp_request_ip[1]
-        &&
-        ip[IP_SRC_IP_OFFSET+2] == ntp_request_ip[2]
-        &&
-        ip[IP_SRC_IP_OFFSET+3] == ntp_request_ip[3]
-        &&
-        UDP_GET_SRC_PORT(udp) == UDP_PORT_NTP
-        &&
-        (NTP_GET_LIVNMODE(ntp) & 0x07) == 4
+        (NTP_GET_LIVNMODE(ntp) & 0x07) != 4     // not a server reply
+        ||
+        (NTP_GET_LIVNMODE(ntp) >> 6) == 3       // unsynchronised
+        ||
+        NTP_GET_STRATUM(ntp) == 0               // kiss-o'-death
     )
+        return;
+
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
     {
+        ntp_request_t   *r  = &ntp_requests[i];
+
         /*
-         * This is an NTP server reply from our NTP server.
-         * Set it in the RTC.
+         * Is this the reply to one of our requests?  The server hands back
+         * our transmit timestamp as the originate timestamp.
          */
-        (*ntp_reply_handler)(NTP_GET_TRANSMIT_SECS(ntp));
+        if
+        (
+            r->state == NTP_SLOT_SENT
+            &&
+            UDP_GET_DST_PORT(udp) == r->port
+            &&
+            ip[IP_SRC_IP_OFFSET+0] == r->ip[0]
+            &&
+            ip[IP_SRC_IP_OFFSET+1] == r->ip[1]
+            &&
+            ip[IP_SRC_IP_OFFSET+2] == r->ip[2]
+            &&
+            ip[IP_SRC_IP_OFFSET+3] == r->ip[3]
+            &&
+            NTP_GET_ORIGINATE_SECS(ntp) == r->t1_secs
+            &&
+            NTP_GET_ORIGINATE_FRACT(ntp) == r->t1_frac
+        )
+        {
+            ntp_take_sample(r, ntp, t4_secs, t4_frac);
 
-        // zero out so we don't accept any more
-        ntp_request_ip[0] = 0;
-        ntp_request_ip[1] = 0;
-        ntp_request_ip[2] = 0;
-        ntp_request_ip[3] = 0;
-    }
+            // no need to wait if every server has answered
+            if (!ntp_round_pending())
+                ntp_finish_round();
 
+            break;
+        }
+    }
 }
 
 static void
-send_sntp_request(uint8_t *server_mac, uint8_t *server_ip)
+send_sntp_request(ntp_request_t *r, uint8_t *server_mac)
 {
     uint8_t         *eth    = pkt;
     uint8_t         *ip     = eth + ETH_HEADER_LEN;
@@ -977,7 +1419,7 @@ send_sntp_request(uint8_t *server_mac, uint8_t *server_ip)
     IP_SET_HDR_LEN(ip, 5);
     IP_SET_TOS(ip, 0);
     IP_SET_LENGTH(ip, IP_HEADER_LEN + UDP_HEADER_LEN + NTP_HEADER_LEN);
-    IP_SET_ID(ip, clock_current_time() ^ ((UDP_PORT_NTP << 8) + UDP_PORT_NTP));
+    IP_SET_ID(ip, clock_current_time() ^ r->port);
     IP_SET_FRAG_FLAGS(ip, IP_FLAG_DONT_FRAGMENT);
     IP_SET_FRAG_OFFSET(ip, 0);
     IP_SET_TTL(ip, 64);
@@ -988,23 +1430,28 @@ send_sntp_request(uint8_t *server_mac, uint8_t *server_ip)
     ip[IP_SRC_IP_OFFSET+2] = ip_address[2];
     ip[IP_SRC_IP_OFFSET+3] = ip_address[3];
 
-    ip[IP_DST_IP_OFFSET+0] = ntp_request_ip[0] = server_ip[0];
-    ip[IP_DST_IP_OFFSET+1] = ntp_request_ip[1] = server_ip[1];
-    ip[IP_DST_IP_OFFSET+2] = ntp_request_ip[2] = server_ip[2];
-    ip[IP_DST_IP_OFFSET+3] = ntp_request_ip[3] = server_ip[3];
+    ip[IP_DST_IP_OFFSET+0] = r->ip[0];
+    ip[IP_DST_IP_OFFSET+1] = r->ip[1];
+    ip[IP_DST_IP_OFFSET+2] = r->ip[2];
+    ip[IP_DST_IP_OFFSET+3] = r->ip[3];
 
     /*
      * Create the UDP header
      */
-    UDP_SET_SRC_PORT(udp, UDP_PORT_NTP);
+    UDP_SET_SRC_PORT(udp, r->port);
     UDP_SET_DST_PORT(udp, UDP_PORT_NTP);
     UDP_SET_LENGTH(udp, UDP_HEADER_LEN + NTP_HEADER_LEN);
 
     /*
-     * Create the NTP header
+     * Create the NTP header.  Our time (T1) goes in the transmit timestamp,
+     * for the server to hand back with the reply.
      */
     NTP_SET_LIVNMODE(ntp, ((3 << 3) + 3));
 
+    ntp_local_time(&r->t1_secs, &r->t1_frac);
+    NTP_SET_TRANSMIT_SECS(ntp, r->t1_secs);
+    NTP_SET_TRANSMIT_FRACT(ntp, r->t1_frac);
+
     /*
      * Build checksums
      */
@@ -1016,11 +1463,14 @@ send_sntp_request(uint8_t *server_mac, uint8_t *server_ip)
      */
     enc28j60_send_packet(eth, pktlen);
 
+    r->state = NTP_SLOT_SENT;
+
     sei();
 }
 
 /*
- * Define a handler to process any incoming NTP replies
+ * Define a handler to process NTP replies.  It is called once per round,
+ * with the time from the best reply.
  */
 void
 network_set_ntp_reply_handler(ntp_reply_handler_t *handler)
@@ -1028,81 +1478,121 @@ network_set_ntp_reply_handler(ntp_reply_handler_t *handler)
     ntp_reply_handler = handler;
 }
 
-static uint32_t
-ntp_request_retry(uint32_t now, uint32_t *data)
+/*
+ * Get the offset and delay measured from the reply used in the last round
+ */
+void
+network_get_ntp_sample(ntp_sample_t *sample)
 {
-    uint8_t server_ip[4];
+    *sample = ntp_last_sample;
+}
 
-    server_ip[0] = (*data & 0xff000000) >> 24;
-    server_ip[1] = (*data & 0x00ff0000) >> 16;
-    server_ip[2] = (*data & 0x0000ff00) >> 8;
-    server_ip[3] = (*data & 0x000000ff);
+/*
+ * Send requests still waiting for an ARP reply, and end the round when
+ * every server has answered or it has run out of time
+ */
+static void
+ntp_round_timeout(uint32_t now, uint32_t data)
+{
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
+    {
+        ntp_request_t   *r  = &ntp_requests[i];
 
-    arp_cache_entry_t   *c = arp_cache_lookup(server_ip);
+        if (r->state == NTP_SLOT_ARP)
+        {
+            arp_cache_entry_t   *c = arp_cache_lookup(r->ip);
 
-    /*
-     * Do we have the server in our ARP cache yet?  If not, then try again
-     * in another 10 ticks.
-     */
-    if (!c || !c->valid)
-    {
-        return now + 10;
+            if (c && c->valid)
+                send_sntp_request(r, c->mac_address);
+        }
     }
 
-    /*
-     * We have a valid ARP entry, so send the NTP request.
-     */
-    send_sntp_request(c->mac_address, c->ip_address);
+    if (!ntp_round_pending() || !clock_time_before(now, ntp_round_end))
+        ntp_finish_round();
+    else
+        timer_wheel_start(&ntp_round_timer, now + NTP_POLL_TICKS, ntp_round_timeout, 0);
+}
 
-    return 0;
+/*
+ * Resend the ARP requests for servers that haven't answered them, in case
+ * the request or the reply was lost
+ */
+static void
+ntp_arp_retry(uint32_t now, uint32_t data)
+{
+    uint8_t     waiting = 0;
+
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
+    {
+        ntp_request_t   *r  = &ntp_requests[i];
+
+        if (r->state == NTP_SLOT_ARP && !arp_cache_lookup(r->ip))
+        {
+            send_arp_request(r->ip);
+            waiting = 1;
+        }
+    }
+
+    if (waiting)
+        timer_wheel_start(&ntp_arp_timer, now + NTP_ARP_RETRY_TICKS, ntp_arp_retry, 0);
 }
 
 /*
- * Initiate an NTP request
+ * Initiate an NTP request.  A request made while a round is in progress
+ * joins that round, so to query several servers call this for each of
+ * them in turn.  Returns 1 if all the request slots are in use.
  */
 uint8_t
 network_send_ntp_request(uint8_t *server_ip)
 {
-    arp_cache_entry_t   *c = arp_cache_lookup(server_ip);
+    ntp_request_t       *r  = 0;
+    arp_cache_entry_t   *c;
+
+    for (uint8_t i = 0; i < NTP_SERVERS; i++)
+    {
+        if (ntp_requests[i].state == NTP_SLOT_FREE)
+        {
+            r = &ntp_requests[i];
+            break;
+        }
+    }
+
+    if (!r)
+        return 1;
+
+    for (uint8_t i = 0; i < 4; i++)
+        r->ip[i] = server_ip[i];
+    r->port = ntp_random_port();
+    r->state = NTP_SLOT_ARP;
+
+    if (!ntp_round_active)
+    {
+        uint32_t    now = clock_current_time();
+
+        ntp_round_active = 1;
+        ntp_round_end = now + NTP_ROUND_TICKS;
+
+        timer_wheel_start(&ntp_round_timer, now + NTP_POLL_TICKS, ntp_round_timeout, 0);
+    }
+
+    c = arp_cache_lookup(server_ip);
 
     /*
      * Do we have the server in our ARP cache?  If not, we need to send out an
-     * ARP request.
+     * ARP request (resent until it is answered), and the round timer sends
+     * the NTP request once it's in.
      */
-
     if (c && c->valid)
     {
-        /*
-         * We have a valid ARP cache entry, so send the NTP request
-         */
-        send_sntp_request(c->mac_address, c->ip_address);
+        send_sntp_request(r, c->mac_address);
     }
     else
+    if (!c)
     {
-        if (!c)
-        {
-            /*
-             * There is no pending ARP request, so send one.
-             */
-            send_arp_request(server_ip);
-        }
-        else
-        {
-            /*
-             * There is already a pending request
-             */
-        }
-
-        /*
-         * Queue up a task to retry the request
-         */
-        uint32_t data
-            = ((uint32_t)server_ip[0] << 24)
-            + ((uint32_t)server_ip[1] << 16)
-            + ((uint32_t)server_ip[2] <<  8)
-            + ((uint32_t)server_ip[3]);
+        send_arp_request(server_ip);
 
-        task_submit(clock_current_time() + 10, 20, ntp_request_retry, data);
+        if (!timer_wheel_pending(&ntp_arp_timer))
+            timer_wheel_start(&ntp_arp_timer, clock_current_time() + NTP_ARP_RETRY_TICKS, ntp_arp_retry, 0);
     }
 
     return 0;
@@ -1301,10 +1791,17 @@ network_set_ip_address(uint8_t *ip)
     ip_set_address(ip);
 }
 
-void
+/*
+ * Process the next received packet, if there is one.  Returns its length,
+ * or 0 if there was nothing waiting.
+ */
+uint16_t
 network_read_packet(void)
 {
-    enc28j60_read_packet(pkt, AVR_FEATURE_NWSTACK_PKT_BUFFER_SIZE);
+    // protocol timeouts
+    timer_wheel_run(clock_current_time());
+
+    return enc28j60_read_packet(pkt, AVR_FEATURE_NWSTACK_PKT_BUFFER_SIZE);
 }
 
 void
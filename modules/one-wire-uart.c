@@ -0,0 +1,247 @@
+/*
+ * 1-Wire bus driven by USART0
+ *
+ * This replaces the bit-banged bus primitives in one-wire.c.  Each time slot
+ * is one UART character at 115200 baud: the start bit is the low pulse that
+ * opens the slot, and the data bits decide how long the bus stays low.
+ * Sending 0xff gives a write-1 (or read) slot; sending 0x00 holds the bus
+ * low for about 78us, giving a write-0 slot.  The bus is read back on RXD,
+ * so a device pulling the bus low during a read slot shows up as a received
+ * character other than 0xff.  The reset pulse is a 0xf0 character sent at
+ * 9600 baud; any presence pulse corrupts the echo.
+ *
+ * TXD must drive the bus through an open-drain buffer (or a diode), and RXD
+ * is connected directly to the bus.  The USART can't be used for anything
+ * else (including uart0).
+ *
+ * All the timing is done by the USART; the CPU only handles one receive
+ * interrupt per slot, so other interrupts don't disturb the bus and the
+ * bus doesn't hold off other interrupts.  The application must call
+ * onewire_uart_intr_handler() from the USART receive interrupt handler
+ * (USART_RX_vect or USART0_RX_vect, depending on the chip), and global
+ * interrupts must be enabled before the blocking functions are used.
+ */
+#include <avr/io.h>
+#include MCU_H
+
+#include "avr-common.h"
+#include "one-wire.h"
+
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+# error "AVR_FEATURE_ONEWIRE_ENABLE_ASYNC can't be used with AVR_FEATURE_ONEWIRE_UART"
+#endif
+
+#define OW_UART_RESET_BAUD  9600
+#define OW_UART_SLOT_BAUD   115200
+
+#define OW_UART_RESET_TX    0xf0
+#define OW_UART_SLOT_1      0xff
+#define OW_UART_SLOT_0      0x00
+
+/*
+ * States of the transfer engine
+ */
+#define OWU_IDLE            0
+#define OWU_RESET           1
+#define OWU_SLOTS           2
+
+static volatile uint8_t state;
+static volatile uint8_t presence;
+static uint8_t          tx_bits;        // bits still to be sent, LSB first
+static volatile uint8_t rx_bits;        // bits received, shifted in at the top
+static uint8_t          slots_left;
+static uint8_t          slots_total;
+static uint8_t          tx_sent;        // a character has been sent since init
+
+/*
+ * Send a character, clearing TXC0 so that ow_uart_set_baud() can wait
+ * for it to finish shifting out
+ */
+static void
+ow_uart_send(uint8_t c)
+{
+    UCSR0A = (1<<TXC0);
+    UDR0 = c;
+    tx_sent = 1;
+}
+
+static void
+ow_uart_set_baud(uint16_t ubrr)
+{
+    /*
+     * Let the last character finish before changing speed: UDRE0 only
+     * says it has moved to the shift register, TXC0 that its stop bit has
+     * gone out
+     */
+    if (tx_sent)
+    {
+        while ((UCSR0A & (1<<TXC0)) == 0)
+            continue;
+    }
+
+    UBRR0H = (ubrr & 0xff00) >> 8;
+    UBRR0L = (ubrr & 0x00ff);
+}
+
+static void
+ow_uart_send_slot(void)
+{
+    ow_uart_send((tx_bits & 0x01) ? OW_UART_SLOT_1 : OW_UART_SLOT_0);
+    tx_bits >>= 1;
+}
+
+/*
+ * Set up USART0 for the bus: 8N1, receive interrupt enabled
+ */
+void
+onewire_init(void)
+{
+    state = OWU_IDLE;
+    tx_sent = 0;
+
+    UCSR0A = 0;
+    ow_uart_set_baud(UBRR(F_CPU, OW_UART_SLOT_BAUD));
+    UCSR0C = (1<<UCSZ01)|(1<<UCSZ00);
+    UCSR0B = (1<<RXEN0)|(1<<TXEN0)|(1<<RXCIE0);
+}
+
+/*
+ * Start a reset/presence sequence
+ */
+void
+onewire_uart_start_reset(void)
+{
+    ow_uart_set_baud(UBRR(F_CPU, OW_UART_RESET_BAUD));
+
+    presence = 0;
+    state = OWU_RESET;
+    ow_uart_send(OW_UART_RESET_TX);
+}
+
+/*
+ * Start a sequence of up to 8 time slots.  Bits of x are sent LSB first; to
+ * read, send 1 bits.
+ */
+void
+onewire_uart_start_bits(uint8_t x, uint8_t nbits)
+{
+    tx_bits = x;
+    rx_bits = 0;
+    slots_left = nbits;
+    slots_total = nbits;
+
+    state = OWU_SLOTS;
+    ow_uart_send_slot();
+}
+
+uint8_t
+onewire_uart_busy(void)
+{
+    return state != OWU_IDLE;
+}
+
+/*
+ * The bits read during the last sequence of time slots, LSB first
+ */
+uint8_t
+onewire_uart_result(void)
+{
+    return rx_bits >> (8 - slots_total);
+}
+
+/*
+ * Did any device respond to the last reset?
+ */
+uint8_t
+onewire_uart_presence(void)
+{
+    return presence;
+}
+
+/*
+ * To be called from the USART receive interrupt handler
+ */
+void
+onewire_uart_intr_handler(void)
+{
+    uint8_t rx  = UDR0;
+
+    switch (state)
+    {
+    case OWU_RESET:
+        presence = rx != OW_UART_RESET_TX;
+        ow_uart_set_baud(UBRR(F_CPU, OW_UART_SLOT_BAUD));
+        state = OWU_IDLE;
+        break;
+
+    case OWU_SLOTS:
+        rx_bits >>= 1;
+        if (rx == OW_UART_SLOT_1)
+            rx_bits |= 0x80;
+
+        if (--slots_left > 0)
+            ow_uart_send_slot();
+        else
+            state = OWU_IDLE;
+        break;
+
+    default:
+        // stray character, e.g. noise on the bus
+        break;
+    }
+}
+
+/*
+ * Blocking bus primitives, as provided by one-wire.c for the bit-banged bus
+ */
+void
+onewire_reset(uint8_t *x)
+{
+    onewire_uart_start_reset();
+
+    while (onewire_uart_busy())
+        continue;
+
+    if (x)
+        *x = presence;
+}
+
+void
+onewire_send_bit(uint8_t x)
+{
+    onewire_uart_start_bits(x ? 1 : 0, 1);
+
+    while (onewire_uart_busy())
+        continue;
+}
+
+void
+onewire_send_byte(uint8_t x)
+{
+    onewire_uart_start_bits(x, 8);
+
+    while (onewire_uart_busy())
+        continue;
+}
+
+uint8_t
+onewire_recv_bit(void)
+{
+    onewire_uart_start_bits(1, 1);
+
+    while (onewire_uart_busy())
+        continue;
+
+    return onewire_uart_result();
+}
+
+uint8_t
+onewire_recv_byte(void)
+{
+    onewire_uart_start_bits(0xff, 8);
+
+    while (onewire_uart_busy())
+        continue;
+
+    return onewire_uart_result();
+}
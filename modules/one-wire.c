@@ -7,6 +7,15 @@
 #include "avr-common.h"
 #include "one-wire.h"
 
+#if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM
+#include "crc8.h"
+#endif
+
+#if !AVR_FEATURE_ONEWIRE_UART
+/*
+ * Bit-banged bus on a GPIO line.  (With AVR_FEATURE_ONEWIRE_UART these
+ * primitives come from one-wire-uart.c instead.)
+ */
 static volatile uint8_t  *ddr_reg;  // the data direction port ID
 static volatile uint8_t  *out_reg;  // the I/O port ID
 static volatile uint8_t  *in_reg;   // the I/O port ID
@@ -171,6 +180,7 @@ onewire_recv_byte(void)
 
     return x;
 }
+#endif /* !AVR_FEATURE_ONEWIRE_UART */
 
 void
 onewire_wait_until_done(void)
@@ -179,6 +189,251 @@ onewire_wait_until_done(void)
         _delay_us(60);
 }
 
+#if AVR_FEATURE_ONEWIRE_ENABLE_ASYNC
+
+/*
+ * Asynchronous transactions.
+ *
+ * Timer2 runs in CTC mode and its compare interrupt steps through the time
+ * slots of a transaction, so the CPU is only busy (with interrupts masked)
+ * for the few microseconds around each slot edge rather than for the whole
+ * 60-960us of each slot or reset.  The longest interval the timer has to
+ * cover is 240us, which fits in 8 bits at clk/32 for F_CPU up to 34MHz.
+ *
+ * The application must call onewire_timer_intr_handler() from the
+ * TIMER2_COMPA_vect interrupt handler.  The blocking functions above must
+ * not be used while an asynchronous transaction is in progress.
+ */
+#define OW_TIMER_PRESCALE   32
+#define OW_US(US)           (((F_CPU / 1000L) * (US)) / (OW_TIMER_PRESCALE * 1000L))
+
+/*
+ * ow_schedule() loads OCR2A with ticks - 1, so the shortest interval (10us)
+ * must be at least one tick and the longest (240us) at most 256
+ */
+#if OW_US(10) < 1
+# error "F_CPU too low for AVR_FEATURE_ONEWIRE_ENABLE_ASYNC (10us rounds to 0 timer ticks)"
+#elif OW_US(240) > 256
+# error "F_CPU too high for AVR_FEATURE_ONEWIRE_ENABLE_ASYNC (240us overflows timer2)"
+#endif
+
+#define OW_TIMER_START()    do { TCCR2B = (1<<CS21) | (1<<CS20); } while (0)
+#define OW_TIMER_STOP()     do { TCCR2B = 0; } while (0)
+
+/*
+ * Transaction states
+ */
+#define OWS_IDLE            0
+#define OWS_RESET_HOLD      1   /* bus held low for the reset pulse */
+#define OWS_RESET_RELEASE   2   /* release the bus, wait for presence */
+#define OWS_RESET_SAMPLE    3   /* sample the presence pulse */
+#define OWS_RESET_RECOVER   4   /* end of the reset sequence */
+#define OWS_SLOT            5   /* start the next time slot */
+#define OWS_SLOT_RELEASE    6   /* end of a write-0 slot */
+
+static volatile uint8_t     ow_state;
+static volatile uint8_t     ow_status;
+static uint8_t              ow_presence;
+
+static const uint8_t        *ow_tx;
+static uint8_t              *ow_rx;
+static uint16_t             ow_tx_bits;
+static uint16_t             ow_rx_bits;
+static uint16_t             ow_bit;
+
+static onewire_async_callback_t *ow_callback;
+
+static void
+ow_schedule(uint8_t ticks)
+{
+    TCNT2 = 0;
+    OCR2A = ticks - 1;
+    TIFR2 = (1<<OCF2A);
+}
+
+static void
+ow_finish(uint8_t status)
+{
+    OW_TIMER_STOP();
+
+    ow_status = status;
+    ow_state = OWS_IDLE;
+
+    if (ow_callback)
+        (*ow_callback)(status);
+}
+
+/*
+ * Start the next time slot, or finish if there are no more bits
+ */
+static void
+ow_next_slot(void)
+{
+    if (ow_bit < ow_tx_bits)
+    {
+        uint8_t bit = ow_tx[ow_bit >> 3] & (1 << (ow_bit & 0x07));
+
+        ow_bit++;
+
+        // pull io_line low to start write slot
+        cbi(*out_reg, io_line);
+        sbi(*ddr_reg, io_line);
+
+        if (bit)
+        {
+            _delay_us(6);
+
+            // release to tri-state
+            cbi(*ddr_reg, io_line);
+
+            ow_schedule(OW_US(64));
+        }
+        else
+        {
+            ow_state = OWS_SLOT_RELEASE;
+            ow_schedule(OW_US(60));
+        }
+    }
+    else
+    if (ow_bit < ow_tx_bits + ow_rx_bits)
+    {
+        uint16_t n  = ow_bit - ow_tx_bits;
+
+        ow_bit++;
+
+        // pull io_line low to start read slot
+        cbi(*out_reg, io_line);
+        sbi(*ddr_reg, io_line);
+
+        _delay_us(6);
+
+        // release to tri-state
+        cbi(*ddr_reg, io_line);
+
+        _delay_us(9);
+
+        // sample io_line
+        if ((*in_reg & (1 << io_line)) != 0)
+            ow_rx[n >> 3] |= (1 << (n & 0x07));
+
+        ow_schedule(OW_US(55));
+    }
+    else
+        ow_finish(OW_ASYNC_OK);
+}
+
+void
+onewire_timer_intr_handler(void)
+{
+    switch (ow_state)
+    {
+    case OWS_RESET_HOLD:
+        ow_state = OWS_RESET_RELEASE;
+        ow_schedule(OW_US(240));
+        break;
+
+    case OWS_RESET_RELEASE:
+        // release to tri-state
+        cbi(*ddr_reg, io_line);
+
+        ow_state = OWS_RESET_SAMPLE;
+        ow_schedule(OW_US(70));
+        break;
+
+    case OWS_RESET_SAMPLE:
+        ow_presence = (*in_reg & (1 << io_line)) == 0;
+
+        ow_state = OWS_RESET_RECOVER;
+        ow_schedule(OW_US(205));
+        break;
+
+    case OWS_RESET_RECOVER:
+        if (!ow_presence)
+        {
+            ow_finish(OW_ASYNC_NO_PRESENCE);
+            break;
+        }
+
+        ow_state = OWS_SLOT;
+        ow_schedule(OW_US(205));
+        break;
+
+    case OWS_SLOT_RELEASE:
+        // release to tri-state
+        cbi(*ddr_reg, io_line);
+
+        ow_state = OWS_SLOT;
+        ow_schedule(OW_US(10));
+        break;
+
+    case OWS_SLOT:
+        ow_next_slot();
+        break;
+    }
+}
+
+/*
+ * Start an asynchronous transaction: optionally reset the bus, then send
+ * ntx bytes from tx and receive nrx bytes into rx.  The buffers must stay
+ * valid until the transaction completes.  The callback (if any) is called
+ * from interrupt context with the final status.
+ *
+ * Returns non-zero if a transaction is already in progress.
+ */
+uint8_t
+onewire_async_start(uint8_t flags, const uint8_t *tx, uint8_t ntx,
+    uint8_t *rx, uint8_t nrx, onewire_async_callback_t *callback)
+{
+    if (ow_state != OWS_IDLE)
+        return 1;
+
+    ow_tx = tx;
+    ow_rx = rx;
+    ow_tx_bits = (uint16_t)ntx * 8;
+    ow_rx_bits = (uint16_t)nrx * 8;
+    ow_bit = 0;
+    ow_callback = callback;
+
+    for (uint8_t i = 0; i < nrx; i++)
+        rx[i] = 0;
+
+    // CTC mode, interrupt on compare match
+    TCCR2A = (1<<WGM21);
+    sbi(TIMSK2, OCIE2A);
+
+    if (flags & OW_ASYNC_RESET)
+    {
+        // pull io_line low for 480us (2 x 240us)
+        sbi(*ddr_reg, io_line);
+        cbi(*out_reg, io_line);
+
+        ow_state = OWS_RESET_HOLD;
+        ow_schedule(OW_US(240));
+    }
+    else
+    {
+        ow_state = OWS_SLOT;
+        ow_schedule(OW_US(10));
+    }
+
+    OW_TIMER_START();
+
+    return 0;
+}
+
+uint8_t
+onewire_async_busy(void)
+{
+    return ow_state != OWS_IDLE;
+}
+
+uint8_t
+onewire_async_status(void)
+{
+    return ow_status;
+}
+#endif /* AVR_FEATURE_ONEWIRE_ENABLE_ASYNC */
+
 #if AVR_FEATURE_ONEWIRE_ENABLE_SEARCHROM
 
 /*
@@ -194,8 +449,8 @@ onewire_scan_init(void)
     done_flag = 0;
 }
 
-uint8_t
-onewire_scan_next(uint64_t *x)
+static uint8_t
+onewire_scan_pass(uint64_t *x)
 {
     uint64_t    serial  = 0;
     uint64_t    mask    = 0x1;
@@ -285,6 +540,34 @@ onewire_scan_next(uint64_t *x)
     return 1;
 }
 
+/*
+ * Find the next device.  A ROM ID with a bad CRC is discarded and the same
+ * search pass repeated once; if that fails too the search is abandoned.
+ */
+uint8_t
+onewire_scan_next(uint64_t *x)
+{
+    uint8_t     saved_discrepancy   = last_discrepancy;
+    uint8_t     saved_done          = done_flag;
+
+    for (uint8_t tries = 0; tries < 2; tries++)
+    {
+        if (!onewire_scan_pass(x))
+            return 0;
+
+        if (crc8_rom(*x) == 0)
+            return 1;
+
+        last_discrepancy = saved_discrepancy;
+        done_flag = saved_done;
+    }
+
+    last_discrepancy = 0;
+    done_flag = 0;
+
+    return 0;
+}
+
 uint8_t
 onewire_scan_first(uint64_t *serial)
 {
@@ -3,16 +3,13 @@
  */
 #include "avr-common.h"
 #include "rtc-ds1307.h"
+#include "datetime.h"
 #include "i2c.h"
 
-#define UNIX_EPOCH_OFFSET   2208988800UL
-#define SECONDS_PER_DAY     86400UL
-#define LEAP_YEAR(Y)        (((Y) % 4) == 0 && ( ((Y) % 100) != 0 || ((Y) % 400) == 0))
-#define DAYS_IN_YEAR(Y)     (LEAP_YEAR(Y) ? 366 : 365)
-#define DAYS_IN_MONTH(M, Y) \
-            ((M) == 2 ? (LEAP_YEAR(Y) ? 29 : 28) : \
-            (((M) == 4 || (M) == 6 || (M) == 9 || (M) == 11) ? 30 : \
-            31))
+#if AVR_FEATURE_CLOCK_WALL_TIME && AVR_FEATURE_TASKS
+#include "clock.h"
+#include "task.h"
+#endif
 
 /*
  * Defined oscillator bit
@@ -30,54 +27,23 @@
 void
 rtc_set_time_from_ntp(uint32_t ntp_time)
 {
-    /*
-     * Convert to Unix epoch for quicker calculations
-     */
-    ntp_time -= UNIX_EPOCH_OFFSET;
-
-    /*
-     * Split into days and seconds, and then break down into datetime
-     * components.
-     */
-    uint32_t daytime = ntp_time % SECONDS_PER_DAY;
-    uint32_t days = (ntp_time - daytime) / SECONDS_PER_DAY;
+    datetime_t  dt;
 
-    uint8_t hh, mm, ss, d, m, dow;
-    uint16_t y;
-
-    ss  = daytime % 60;
-    daytime = (daytime - ss) / 60;
-    mm = daytime % 60;
-    hh = (daytime - mm) / 60;
-
-    dow = (days + 3) % 7;
-
-    y = 1970;
-    while (days > DAYS_IN_YEAR(y))
-    {
-        days -= DAYS_IN_YEAR(y);
-        y++;
-    }
-    m = 1;
-    while (days > DAYS_IN_MONTH(m, y))
-    {
-        days -= DAYS_IN_MONTH(m, y);
-        m++;
-    }
-    d = days + 1;   // 1-based
+    datetime_from_unix(ntp_time - UNIX_EPOCH_OFFSET, &dt);
 
     /*
-     * Set up RTC registers to write out
+     * Set up RTC registers to write out.  The DS1307 day of the week runs
+     * from 1 (Monday) to 7.
      */
     uint8_t reg[8];
 
-    reg[0] = (ss / 10) << 4 | ss % 10;
-    reg[1] = (mm / 10) << 4 | mm % 10;
-    reg[2] = (hh / 10) << 4 | hh % 10;
-    reg[3] = dow + 1;
-    reg[4] = (d / 10) << 4 | d % 10;
-    reg[5] = (m / 10) << 4 | m % 10;
-    reg[6] = ((y - 2000) / 10) << 4 | (y - 2000) % 10;
+    reg[0] = datetime_bcd_pack(dt.sec);
+    reg[1] = datetime_bcd_pack(dt.min);
+    reg[2] = datetime_bcd_pack(dt.hour);
+    reg[3] = (dt.wday + 6) % 7 + 1;
+    reg[4] = datetime_bcd_pack(dt.day);
+    reg[5] = datetime_bcd_pack(dt.month);
+    reg[6] = datetime_bcd_pack(dt.year - 2000);
     reg[7] = 0;
 
     /*
@@ -118,25 +84,25 @@ rtc_get_time(uint8_t *sec, uint8_t *min, uint8_t *hr, uint8_t *day, uint8_t *mon
         goto ERROR;
 
     r = i2c_read_byte_ack();
-    *sec = ((r & 0x70) >> 4) * 10 + (r & 0x0f);
+    *sec = datetime_bcd_unpack(r & 0x7f);
 
     r = i2c_read_byte_ack();
-    *min = ((r & 0x70) >> 4) * 10 + (r & 0x0f);
+    *min = datetime_bcd_unpack(r & 0x7f);
 
     r = i2c_read_byte_ack();
-    *hr = ((r & 0x30) >> 4) * 10 + (r & 0x0f);
+    *hr = datetime_bcd_unpack(r & 0x3f);
 
     r = i2c_read_byte_ack();
     *dow = r & 0x07;
 
     r = i2c_read_byte_ack();
-    *day = ((r & 0x30) >> 4) * 10 + (r & 0x0f);
+    *day = datetime_bcd_unpack(r & 0x3f);
 
     r = i2c_read_byte_ack();
-    *month = ((r & 0x10) >> 4) * 10 + (r & 0x0f);
+    *month = datetime_bcd_unpack(r & 0x1f);
 
     r = i2c_read_byte_nack();
-    *year = ((r & 0xf0) >> 4) * 10 + (r & 0x0f);
+    *year = datetime_bcd_unpack(r);
 
     i2c_stop();
 
@@ -146,6 +112,24 @@ ERROR:
     return 1;
 }
 
+/*
+ * Read the time as a datetime_t (assuming the 21st century)
+ */
+uint8_t
+rtc_get_datetime(datetime_t *dt)
+{
+    uint8_t dow;
+    uint8_t year;
+
+    if (rtc_get_time(&dt->sec, &dt->min, &dt->hour, &dt->day, &dt->month, &year, &dow) != 0)
+        return 1;
+
+    dt->year = 2000 + year;
+    dt->wday = dow % 7;     // 7 (Sunday) -> 0
+
+    return 0;
+}
+
 uint8_t
 rtc_init(void)
 {
@@ -168,3 +152,93 @@ rtc_init(void)
 ERROR:
     return 1;
 }
+
+#if AVR_FEATURE_CLOCK_WALL_TIME && AVR_FEATURE_TASKS
+
+/*
+ * Keep the software wall clock in step with the RTC.
+ *
+ * The DS1307 only reports whole seconds, so a sync task reads the seconds
+ * register once a tick until it changes; at that point the RTC is at the
+ * start of a second, and the wall clock can be corrected to within a tick.
+ * It then sleeps until the next sync period.
+ */
+#define SYNC_MAX_POLLS      150     /* give up if the RTC doesn't tick */
+#define SYNC_IDLE           0xff
+
+static uint32_t        sync_period;
+static task_handle_t   sync_handle = TASK_INVALID;
+
+static uint8_t
+rtc_read_seconds(uint8_t *sec)
+{
+    if (i2c_start(I2C_ADDR_DS1307, I2C_SLA_W) != 0)
+        goto ERROR;
+
+    if (i2c_send_byte(0x00) != 0)
+        goto ERROR;
+
+    if (i2c_rep_start(I2C_ADDR_DS1307, I2C_SLA_R) != 0)
+        goto ERROR;
+
+    *sec = i2c_read_byte_nack();
+
+    i2c_stop();
+
+    return 0;
+
+ERROR:
+    i2c_stop();
+
+    return 1;
+}
+
+/*
+ * data holds the number of polls so far (bits 8-15) and the last seconds
+ * register value (bits 0-7), or SYNC_IDLE between syncs
+ */
+static uint32_t
+rtc_sync_task(uint32_t now, uint32_t *data)
+{
+    uint8_t     polls   = *data >> 8;
+    uint8_t     last    = *data & 0xff;
+    uint8_t     sec;
+    datetime_t  dt;
+
+    if (rtc_read_seconds(&sec) != 0 || polls == SYNC_MAX_POLLS)
+        goto DONE;
+
+    if (last == SYNC_IDLE || sec == last)
+    {
+        *data = ((uint32_t)(polls + 1) << 8) | sec;
+        return now + 1;
+    }
+
+    if (rtc_get_datetime(&dt) == 0)
+        clock_sync_wall_time(datetime_to_unix(&dt), 0);
+
+DONE:
+    *data = SYNC_IDLE;
+
+    return now + sync_period;
+}
+
+/*
+ * Set the wall clock from the RTC now, and then every period clock ticks.
+ * Calling this again replaces the previous sync.  Returns non-zero if
+ * there is no free task slot.
+ */
+uint8_t
+rtc_start_clock_sync(uint32_t period)
+{
+    sync_period = period;
+
+    task_cancel(sync_handle);
+
+    sync_handle = task_submit(clock_current_time(), 0, rtc_sync_task, SYNC_IDLE);
+    if (sync_handle == TASK_INVALID)
+        return 1;
+
+    return 0;
+}
+#endif /* AVR_FEATURE_CLOCK_WALL_TIME && AVR_FEATURE_TASKS */
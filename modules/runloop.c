@@ -0,0 +1,242 @@
+/*
+ * Sleep-until-next-event main loop
+ *
+ * Instead of polling the network and the task list flat out, the main loop
+ * calls runloop_poll(), which puts the CPU in idle sleep until a task or
+ * timer is due or an interrupt handler calls runloop_wake().  The module
+ * doesn't define any ISRs itself; the application's handlers report what
+ * woke them, e.g.
+ *
+ *      ISR(INT0_vect)
+ *      {
+ *          runloop_wake(RUNLOOP_WAKE_NET);
+ *      }
+ *
+ *      ISR(USART_RX_vect)
+ *      {
+ *          uart0_intr_handler();
+ *          runloop_wake(RUNLOOP_WAKE_UART);
+ *      }
+ *
+ *      int
+ *      main(void)
+ *      {
+ *          ...
+ *          for (;;)
+ *          {
+ *              uint8_t woken   = runloop_poll();
+ *
+ *              if (woken & RUNLOOP_WAKE_UART)
+ *                  ...
+ *          }
+ *      }
+ *
+ * The ENC28J60 is only read when its interrupt has fired, so an idle node
+ * does no SPI traffic at all.  Tasks and timers are run on every pass.
+ * With AVR_FEATURE_CLOCK_TICKLESS the clock interrupt is set for the next
+ * deadline; otherwise the CPU also wakes on every tick, finds nothing due
+ * and goes back to sleep.
+ */
+#include <avr/interrupt.h>
+#include <avr/sleep.h>
+#include <util/atomic.h>
+
+#include "avr-common.h"
+#include "clock.h"
+#include "runloop.h"
+
+#if AVR_FEATURE_TASKS
+#include "task.h"
+#endif
+
+#if AVR_FEATURE_TIMER_WHEEL || AVR_FEATURE_NWSTACK
+#define RUNLOOP_TIMER_WHEEL     1
+#include "timer-wheel.h"
+#endif
+
+#if AVR_FEATURE_NWSTACK
+#include "nw-stack.h"
+#endif
+
+static volatile uint8_t     pending;        // set by runloop_wake()
+static volatile uint32_t    wake_us;        // time of the first of them
+static uint8_t              again;          // sources still to be finished
+
+static runloop_stats_t      loop_stats;
+
+/*
+ * Find the first tick at which a task or timer will be ready to run.
+ * Returns 1 if there are none.
+ */
+static uint8_t
+runloop_next_wakeup(uint32_t *wake)
+{
+    uint8_t     found   = 0;
+
+#if AVR_FEATURE_TASKS
+    uint32_t    task_due;
+
+    if (task_next_deadline(&task_due) == 0)
+    {
+        // tasks run on the first tick after next_run
+        *wake = task_due + 1;
+        found = 1;
+    }
+#endif
+
+#if RUNLOOP_TIMER_WHEEL
+    uint32_t    timer_due;
+
+    if (timer_wheel_next_deadline(&timer_due) == 0 && (!found || clock_time_before(timer_due, *wake)))
+    {
+        *wake = timer_due;
+        found = 1;
+    }
+#endif
+
+    return found ? 0 : 1;
+}
+
+void
+runloop_init(void)
+{
+    set_sleep_mode(SLEEP_MODE_IDLE);
+
+    pending = 0;
+    again = 0;
+
+#if AVR_FEATURE_NWSTACK
+    // pick up anything that arrived before INT0 was enabled
+    again = RUNLOOP_WAKE_NET;
+#endif
+
+    runloop_clear_stats();
+}
+
+/*
+ * Record a wake source.  This is meant to be called from interrupt
+ * handlers, but is safe anywhere.
+ */
+void
+runloop_wake(uint8_t source)
+{
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        if (pending == 0)
+            wake_us = clock_now_us();
+
+        pending |= source;
+    }
+}
+
+/*
+ * Sleep until there is something to do, then do the library's share of it:
+ * read a packet if the ENC28J60 interrupted, and run any tasks and timers
+ * that are due.  Returns the wake sources, so the caller can handle the
+ * rest (UART, TWI and its own).
+ */
+uint8_t
+runloop_poll(void)
+{
+    uint8_t     sources;
+    uint8_t     woken;
+    uint8_t     slept   = 0;
+    uint32_t    since;
+
+    for (;;)
+    {
+        uint32_t    wake;
+        uint8_t     have_wake;
+
+        /*
+         * Check with interrupts off, so that a wakeup can't slip in
+         * between finding nothing to do and going to sleep
+         */
+        cli();
+
+        have_wake = (runloop_next_wakeup(&wake) == 0);
+
+        woken = pending;
+        since = wake_us;
+        pending = 0;
+
+        sources = woken | again;
+        again = 0;
+
+        if (have_wake && !clock_time_before(clock_current_time(), wake))
+            sources |= RUNLOOP_WAKE_TIMER;
+
+        if (sources)
+            break;
+
+        if (slept)
+            loop_stats.idle_wakeups++;
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+        if (have_wake)
+            clock_set_wakeup(wake);
+#endif
+
+        loop_stats.sleeps++;
+        slept = 1;
+
+        // the instruction after sei() always runs, so no interrupt is missed
+        sleep_enable();
+        sei();
+        sleep_cpu();
+        sleep_disable();
+    }
+
+    sei();
+
+    if (woken)
+    {
+        uint32_t    latency = clock_elapsed_us(since);
+
+        loop_stats.last_latency_us = latency < 0xffff ? latency : 0xffff;
+        if (loop_stats.last_latency_us > loop_stats.max_latency_us)
+            loop_stats.max_latency_us = loop_stats.last_latency_us;
+    }
+
+    loop_stats.wakeups++;
+    loop_stats.last_sources = sources;
+
+#if AVR_FEATURE_NWSTACK
+    /*
+     * INT0 only fires once for a batch of packets, so keep reading until
+     * the ENC28J60 is empty
+     */
+    if (sources & RUNLOOP_WAKE_NET)
+    {
+        if (network_read_packet() != 0)
+            again |= RUNLOOP_WAKE_NET;
+    }
+#endif
+
+#if AVR_FEATURE_TASKS
+    task_run_ready(clock_current_time());
+#endif
+
+#if RUNLOOP_TIMER_WHEEL
+    timer_wheel_run(clock_current_time());
+#endif
+
+    return sources;
+}
+
+void
+runloop_get_stats(runloop_stats_t *stats)
+{
+    *stats = loop_stats;
+}
+
+void
+runloop_clear_stats(void)
+{
+    loop_stats.sleeps = 0;
+    loop_stats.wakeups = 0;
+    loop_stats.idle_wakeups = 0;
+    loop_stats.last_sources = 0;
+    loop_stats.last_latency_us = 0;
+    loop_stats.max_latency_us = 0;
+}
@@ -0,0 +1,312 @@
+/*
+ * Periodic sampling of several sensors at once
+ *
+ * Each sensor is registered with a sampling period and a function that
+ * starts a conversion without waiting for it, e.g. a wrapper around
+ * ds1820_start_temperature(), hp30_start_measurement() or
+ * sht71_start_measurement().  A single task starts each conversion when it
+ * is due, so conversions on different buses overlap rather than running
+ * one after another.  The start function is given a tag for the
+ * conversion, and the driver's completion callback passes each value to
+ * sampler_record() and then calls sampler_complete() with that tag:
+ *
+ *      static sampler_tag_t    baro_tag;
+ *
+ *      static uint8_t
+ *      baro_start(sampler_tag_t tag)
+ *      {
+ *          baro_tag = tag;
+ *          return hp30_start_measurement(hp30_done);
+ *      }
+ *
+ *      static void
+ *      hp30_done(uint8_t status, const hp30_measure_t *values)
+ *      {
+ *          if (status == 0)
+ *          {
+ *              sampler_record(baro_tag, 0, values->pressure);
+ *              sampler_record(baro_tag, 1, values->temperature);
+ *          }
+ *          sampler_complete(baro_tag, status);
+ *      }
+ *
+ * A conversion that hasn't finished after a whole period is abandoned and
+ * counted as failed; if it finishes later, its tag is stale and its
+ * results are ignored.
+ * Results are kept in a ring buffer, oldest first, until they are taken
+ * with sampler_read(); if the buffer fills, the oldest result is dropped.
+ * None of these functions may be called from an interrupt handler.
+ */
+#include "avr-common.h"
+#include "clock.h"
+#include "task.h"
+#include "sampler.h"
+
+#ifdef AVR_FEATURE_SAMPLER_MAX_SENSORS
+# define SAMPLER_MAX_SENSORS    AVR_FEATURE_SAMPLER_MAX_SENSORS
+#else
+# define SAMPLER_MAX_SENSORS    4
+#endif
+
+#ifdef AVR_FEATURE_SAMPLER_BUFFER
+# define BUFFER_LEN     AVR_FEATURE_SAMPLER_BUFFER
+#else
+# define BUFFER_LEN     16
+#endif
+
+#define SF_BUSY         0x01    /* a conversion is in progress */
+#define SF_SAMPLED      0x02    /* last_sample is valid */
+
+typedef struct
+{
+    sampler_start_t     *start;
+    uint16_t            period;
+    uint8_t             flags;
+    uint8_t             seq;        // sequence number of the conversion
+    uint32_t            due;
+    uint32_t            started_at;
+    uint32_t            last_sample;
+    sampler_stats_t     stats;
+}
+    sampler_sensor_t;
+
+static sampler_sensor_t sensors[SAMPLER_MAX_SENSORS];
+static uint8_t          sampler_count;
+
+static sampler_sample_t buffer[BUFFER_LEN];
+static uint8_t          buf_head;   // next slot to write
+static uint8_t          buf_count;
+static uint16_t         overruns;
+
+static task_handle_t    sampler_handle  = TASK_INVALID;
+
+/*
+ * Add a sensor to be sampled every period clock ticks.  Returns the sensor
+ * number, or SAMPLER_NO_SENSOR if there is no room.
+ */
+uint8_t
+sampler_add_sensor(uint16_t period, sampler_start_t *start)
+{
+    sampler_sensor_t    *s;
+
+    if (sampler_count == SAMPLER_MAX_SENSORS || period == 0)
+        return SAMPLER_NO_SENSOR;
+
+    s = &sensors[sampler_count];
+    s->start = start;
+    s->period = period;
+    s->flags = 0;
+    s->due = clock_current_time() + 1;
+
+    return sampler_count++;
+}
+
+static uint32_t
+sampler_task(uint32_t now, uint32_t *data)
+{
+    uint32_t    t       = clock_current_time();
+    uint32_t    next    = t + 0x7fff;
+
+    for (uint8_t i = 0; i < sampler_count; i++)
+    {
+        sampler_sensor_t    *s  = &sensors[i];
+
+        if (!clock_time_before(t, s->due))
+        {
+            uint32_t    jitter  = t - s->due;
+
+            if (jitter > s->stats.max_jitter)
+                s->stats.max_jitter = jitter > 0xffff ? 0xffff : jitter;
+
+            if (s->flags & SF_BUSY)
+            {
+                s->stats.missed++;
+
+                // give up on a conversion that has taken a whole period
+                if (t - s->started_at >= s->period)
+                {
+                    s->flags &= ~SF_BUSY;
+                    s->stats.failed++;
+                }
+            }
+            else
+            {
+                // busy first, in case the driver completes within start()
+                s->seq++;
+                s->flags |= SF_BUSY;
+                s->started_at = t;
+
+                if
+                (
+                    (*s->start)((uint16_t)s->seq << 8 | i) != 0
+                    &&
+                    (s->flags & SF_BUSY)
+                )
+                {
+                    s->flags &= ~SF_BUSY;
+                    s->stats.missed++;
+                }
+                else
+                {
+                    // including one that failed within start(), and was
+                    // counted by sampler_complete()
+                    s->stats.started++;
+                }
+            }
+
+            // stay in phase, but don't try to catch up on missed periods
+            s->due += s->period;
+            if (!clock_time_before(t, s->due))
+                s->due = t + s->period;
+        }
+
+        if (clock_time_before(s->due, next))
+            next = s->due;
+    }
+
+    // tasks run on the first tick after next_run (and 0 would delete it)
+    next--;
+
+    return next ? next : 1;
+}
+
+/*
+ * Start (or restart) sampling the registered sensors.  Returns non-zero if
+ * there are none, or there is no free task slot.
+ */
+uint8_t
+sampler_start(void)
+{
+    if (sampler_count == 0)
+        return 1;
+
+    task_cancel(sampler_handle);
+
+    sampler_handle = task_submit(clock_current_time(), 0, sampler_task, 0);
+    if (sampler_handle == TASK_INVALID)
+        return 1;
+
+    return 0;
+}
+
+/*
+ * The sensor a conversion's tag belongs to, or 0 if the conversion is no
+ * longer in progress
+ */
+static sampler_sensor_t *
+sampler_tag_lookup(sampler_tag_t tag)
+{
+    sampler_sensor_t    *s;
+
+    if (sampler_tag_sensor(tag) >= sampler_count)
+        return 0;
+
+    s = &sensors[sampler_tag_sensor(tag)];
+    if ((s->flags & SF_BUSY) == 0 || s->seq != (uint8_t)(tag >> 8))
+        return 0;
+
+    return s;
+}
+
+/*
+ * Store a result from a conversion
+ */
+void
+sampler_record(sampler_tag_t tag, uint8_t channel, int32_t value)
+{
+    sampler_sample_t    *p  = &buffer[buf_head];
+
+    if (sampler_tag_lookup(tag) == 0)
+        return;
+
+    p->time = clock_current_time();
+    p->sensor = sampler_tag_sensor(tag);
+    p->channel = channel;
+    p->value = value;
+
+    if (++buf_head == BUFFER_LEN)
+        buf_head = 0;
+
+    if (buf_count == BUFFER_LEN)
+        overruns++;
+    else
+        buf_count++;
+}
+
+/*
+ * Mark the end of a conversion; status is 0 if it succeeded
+ */
+void
+sampler_complete(sampler_tag_t tag, uint8_t status)
+{
+    sampler_sensor_t    *s  = sampler_tag_lookup(tag);
+    uint32_t            t   = clock_current_time();
+    uint32_t            latency;
+
+    if (s == 0)
+        return;
+
+    s->flags &= ~SF_BUSY;
+
+    latency = t - s->started_at;
+    s->stats.last_latency = latency > 0xffff ? 0xffff : latency;
+    if (s->stats.last_latency > s->stats.max_latency)
+        s->stats.max_latency = s->stats.last_latency;
+
+    if (status != 0)
+    {
+        s->stats.failed++;
+        return;
+    }
+
+    s->stats.completed++;
+    s->last_sample = t;
+    s->flags |= SF_SAMPLED;
+}
+
+/*
+ * Take the oldest result from the buffer.  Returns 0 if it is empty.
+ */
+uint8_t
+sampler_read(sampler_sample_t *sample)
+{
+    uint8_t tail;
+
+    if (buf_count == 0)
+        return 0;
+
+    tail = buf_head >= buf_count ? buf_head - buf_count : buf_head + BUFFER_LEN - buf_count;
+    *sample = buffer[tail];
+    buf_count--;
+
+    return 1;
+}
+
+/*
+ * The number of results dropped because the buffer was full
+ */
+uint16_t
+sampler_overruns(void)
+{
+    return overruns;
+}
+
+/*
+ * How stale a sensor's data is: the number of clock ticks since its last
+ * successful conversion, or 0xffffffff if it hasn't had one.
+ */
+uint32_t
+sampler_age(uint8_t sensor)
+{
+    if (sensor >= sampler_count || (sensors[sensor].flags & SF_SAMPLED) == 0)
+        return 0xffffffff;
+
+    return clock_current_time() - sensors[sensor].last_sample;
+}
+
+void
+sampler_get_stats(uint8_t sensor, sampler_stats_t *stats)
+{
+    if (sensor < sampler_count)
+        *stats = sensors[sensor].stats;
+}
@@ -0,0 +1,512 @@
+/*
+ * Implement Sensirion SHT71 humidity/temperature sensor functions
+ *
+ * The sensor uses a two-wire interface that looks a bit like I2C but isn't:
+ * SCK is driven by us, and DATA is open-drain with an external pull-up.
+ * After a measurement command the sensor pulls DATA low when the result is
+ * ready, 20-320ms later depending on the resolution.
+ */
+#include <stdint.h>
+#include <avr/io.h>
+#include <util/delay.h>
+#include <util/atomic.h>
+
+#include "avr-common.h"
+#include "sht71.h"
+
+#if AVR_FEATURE_TASKS
+#include "clock.h"
+#include "task.h"
+#endif
+
+#define SHT71_CMD_MEASURE_T     0x03
+#define SHT71_CMD_MEASURE_RH    0x05
+#define SHT71_CMD_READ_STATUS   0x07
+#define SHT71_CMD_WRITE_STATUS  0x06
+#define SHT71_CMD_SOFT_RESET    0x1e
+
+#define SHT71_STATUS_LOW_RES    0x01    /* 8 bit RH, 12 bit temperature */
+
+#define SHT71_TIMEOUT_MS        400
+
+static gpio_line_t  sck;
+static gpio_line_t  data;
+
+static uint8_t      status_reg;         // our copy of the status register
+
+#define SCK_HIGH()      sbi(*sck.p_out, sck.line)
+#define SCK_LOW()       cbi(*sck.p_out, sck.line)
+#define DATA_LOW()      sbi(*data.ddr, data.line)
+#define DATA_RELEASE()  cbi(*data.ddr, data.line)
+#define DATA_IS_HIGH()  ((*data.p_in & (1 << data.line)) != 0)
+
+#define SHT71_DELAY()   _delay_us(2)
+
+/*
+ * CRC-8 (x^8 + x^5 + x^4 + 1), computed MSB first and seeded with the low
+ * nibble of the status register, bit-reversed.  The sensor sends the CRC
+ * bit-reversed too.  (Sensirion application note "CRC Calculation".)
+ */
+static uint8_t
+sht71_reverse(uint8_t x)
+{
+    uint8_t r   = 0;
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        r = (r << 1) | (x & 0x01);
+        x >>= 1;
+    }
+
+    return r;
+}
+
+static uint8_t
+sht71_crc_update(uint8_t crc, uint8_t x)
+{
+    crc ^= x;
+
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        if (crc & 0x80)
+            crc = (crc << 1) ^ 0x31;
+        else
+            crc <<= 1;
+    }
+
+    return crc;
+}
+
+static uint8_t
+sht71_crc_init(void)
+{
+    return sht71_reverse(status_reg & 0x0f);
+}
+
+/*
+ * Transmission start sequence: DATA falls while SCK is high, then rises
+ * again during the next SCK pulse
+ */
+static void
+sht71_transmission_start(void)
+{
+    DATA_RELEASE();
+    SCK_HIGH();
+    SHT71_DELAY();
+    DATA_LOW();
+    SHT71_DELAY();
+    SCK_LOW();
+    SHT71_DELAY();
+    SCK_HIGH();
+    SHT71_DELAY();
+    DATA_RELEASE();
+    SHT71_DELAY();
+    SCK_LOW();
+    SHT71_DELAY();
+}
+
+/*
+ * Connection reset: at least 9 SCK pulses with DATA high
+ */
+static void
+sht71_connection_reset(void)
+{
+    DATA_RELEASE();
+
+    for (uint8_t i = 0; i < 9; i++)
+    {
+        SCK_HIGH();
+        SHT71_DELAY();
+        SCK_LOW();
+        SHT71_DELAY();
+    }
+
+    sht71_transmission_start();
+}
+
+/*
+ * Send a byte, MSB first.  Returns non-zero if the sensor didn't ACK.
+ */
+static uint8_t
+sht71_send_byte(uint8_t x)
+{
+    uint8_t nack;
+
+    for (uint8_t mask = 0x80; mask; mask >>= 1)
+    {
+        if (x & mask)
+            DATA_RELEASE();
+        else
+            DATA_LOW();
+
+        SHT71_DELAY();
+        SCK_HIGH();
+        SHT71_DELAY();
+        SCK_LOW();
+    }
+
+    DATA_RELEASE();
+    SHT71_DELAY();
+    SCK_HIGH();
+    SHT71_DELAY();
+    nack = DATA_IS_HIGH();
+    SCK_LOW();
+
+    return nack;
+}
+
+/*
+ * Receive a byte, MSB first, then ACK it (or not, for the last byte)
+ */
+static uint8_t
+sht71_recv_byte(uint8_t ack)
+{
+    uint8_t x   = 0;
+
+    DATA_RELEASE();
+
+    for (uint8_t mask = 0x80; mask; mask >>= 1)
+    {
+        SCK_HIGH();
+        SHT71_DELAY();
+        if (DATA_IS_HIGH())
+            x |= mask;
+        SCK_LOW();
+        SHT71_DELAY();
+    }
+
+    if (ack)
+        DATA_LOW();
+
+    SCK_HIGH();
+    SHT71_DELAY();
+    SCK_LOW();
+    DATA_RELEASE();
+    SHT71_DELAY();
+
+    return x;
+}
+
+static uint8_t
+sht71_command(uint8_t cmd)
+{
+    sht71_transmission_start();
+
+    return sht71_send_byte(cmd) ? SHT71_ERR_NOACK : SHT71_OK;
+}
+
+/*
+ * Read the 16 bit result of a measurement and check its CRC
+ */
+static uint8_t
+sht71_read_result(uint8_t cmd, uint16_t *result)
+{
+    uint8_t msb = sht71_recv_byte(1);
+    uint8_t lsb = sht71_recv_byte(1);
+    uint8_t crc = sht71_recv_byte(0);
+
+    uint8_t c   = sht71_crc_init();
+
+    c = sht71_crc_update(c, cmd);
+    c = sht71_crc_update(c, msb);
+    c = sht71_crc_update(c, lsb);
+
+    if (c != sht71_reverse(crc))
+        return SHT71_ERR_CRC;
+
+    *result = (msb << 8) | lsb;
+
+    return SHT71_OK;
+}
+
+void
+sht71_init(gpio_line_t *sck_line, gpio_line_t *data_line)
+{
+    sck = *sck_line;
+    data = *data_line;
+
+    sbi(*sck.ddr, sck.line);
+    cbi(*sck.p_out, sck.line);
+
+    cbi(*data.ddr, data.line);
+    cbi(*data.p_out, data.line);    // no internal pull-up; open-drain
+
+    status_reg = 0;
+
+    // allow for the 11ms power-up time
+    _delay_ms(11);
+
+    sht71_connection_reset();
+}
+
+/*
+ * Read the status register.  Returns the last value written if the read
+ * fails.
+ */
+uint8_t
+sht71_read_status(void)
+{
+    uint8_t value;
+    uint8_t crc;
+    uint8_t c;
+
+    if (sht71_command(SHT71_CMD_READ_STATUS) != SHT71_OK)
+        goto ERROR;
+
+    value = sht71_recv_byte(1);
+    crc = sht71_recv_byte(0);
+
+    c = sht71_crc_init();
+    c = sht71_crc_update(c, SHT71_CMD_READ_STATUS);
+    c = sht71_crc_update(c, value);
+
+    if (c != sht71_reverse(crc))
+        goto ERROR;
+
+    status_reg = value;
+
+ERROR:
+    return status_reg;
+}
+
+void
+sht71_write_status(uint8_t v)
+{
+    if (sht71_command(SHT71_CMD_WRITE_STATUS) != SHT71_OK)
+        return;
+
+    if (sht71_send_byte(v) == 0)
+        status_reg = v;
+}
+
+void
+sht71_soft_reset(void)
+{
+    sht71_connection_reset();
+    sht71_command(SHT71_CMD_SOFT_RESET);
+
+    status_reg = 0;
+
+    // wait for the sensor to restart
+    _delay_ms(11);
+}
+
+/*
+ * Make a measurement, waiting for it to complete
+ */
+static uint8_t
+sht71_measure(uint8_t cmd, uint16_t *result)
+{
+    uint8_t err;
+
+    if ((err = sht71_command(cmd)) != SHT71_OK)
+        return err;
+
+    for (uint16_t ms = 0; DATA_IS_HIGH(); ms++)
+    {
+        if (ms == SHT71_TIMEOUT_MS)
+        {
+            sht71_connection_reset();
+            return SHT71_ERR_TIMEOUT;
+        }
+
+        _delay_ms(1);
+    }
+
+    return sht71_read_result(cmd, result);
+}
+
+/*
+ * Read the raw temperature and humidity values.  Returns non-zero if the
+ * sensor couldn't be read.
+ */
+uint8_t
+sht71_read_values(sht71_measure_t *values)
+{
+    uint8_t err;
+
+    if ((err = sht71_measure(SHT71_CMD_MEASURE_T, &values->temperature)) != SHT71_OK)
+        return err;
+
+    return sht71_measure(SHT71_CMD_MEASURE_RH, &values->humidity);
+}
+
+#if AVR_FEATURE_TASKS
+
+/*
+ * Non-blocking measurement.  The measurement command is sent and the task
+ * scheduler checks back when the result should be ready; the result is
+ * read once DATA has gone low, and the humidity measurement then started
+ * in the same way.
+ *
+ * If sht71_set_ready_interrupt() has been called, the falling edge on DATA
+ * is caught by a pin change interrupt instead: the task sleeps until the
+ * timeout, and the interrupt handler wakes it as soon as the result is
+ * ready, so the line isn't polled at all.  The application must call
+ * sht71_intr_handler() from the PCINTn_vect handler, and enable the pin
+ * change interrupt group in PCICR.
+ */
+static sht71_callback_t     *measure_callback;
+static sht71_measure_t      measure_values;
+static uint32_t             measure_deadline;
+static task_handle_t        measure_task    = TASK_INVALID;
+
+static volatile uint8_t     *ready_pcmsk;
+static uint8_t              ready_bit;
+static volatile uint8_t     data_ready;
+
+void
+sht71_set_ready_interrupt(volatile uint8_t *pcmsk, uint8_t bit)
+{
+    ready_pcmsk = pcmsk;
+    ready_bit = bit;
+}
+
+void
+sht71_intr_handler(void)
+{
+    if (ready_pcmsk && !DATA_IS_HIGH())
+    {
+        cbi(*ready_pcmsk, ready_bit);
+        data_ready = 1;
+
+        task_wake(measure_task);
+    }
+}
+
+static uint8_t
+sht71_measurement_ready(void)
+{
+    if (ready_pcmsk)
+        return data_ready;
+
+    return !DATA_IS_HIGH();
+}
+
+/*
+ * Nominal measurement time, in 10ms clock ticks
+ */
+static uint8_t
+sht71_measurement_ticks(uint8_t cmd)
+{
+    if (cmd == SHT71_CMD_MEASURE_T)
+        return status_reg & SHT71_STATUS_LOW_RES ? 8 : 32;
+    else
+        return status_reg & SHT71_STATUS_LOW_RES ? 2 : 8;
+}
+
+/*
+ * Send a measurement command and work out when to check back: when it
+ * should be done if polling, or at the timeout if the interrupt will wake
+ * the task
+ */
+static uint8_t
+sht71_start(uint8_t cmd, uint32_t now, uint32_t *next_run)
+{
+    uint8_t err;
+    uint8_t ticks   = sht71_measurement_ticks(cmd);
+
+    data_ready = 0;
+
+    if ((err = sht71_command(cmd)) != SHT71_OK)
+        return err;
+
+    // the ACK has been released, so DATA is high until the result is ready
+    if (ready_pcmsk)
+        sbi(*ready_pcmsk, ready_bit);
+
+    measure_deadline = now + 2 * ticks;
+    *next_run = ready_pcmsk ? measure_deadline : now + ticks;
+
+    return SHT71_OK;
+}
+
+static uint32_t
+sht71_measure_task(uint32_t now, uint32_t *data)
+{
+    sht71_callback_t    *callback;
+    uint32_t            next_run;
+    uint16_t            result;
+    uint8_t             err;
+
+    if (!sht71_measurement_ready())
+    {
+        if (clock_time_before(now, measure_deadline))
+            return ready_pcmsk ? measure_deadline : now + 1;
+
+        sht71_connection_reset();
+        err = SHT71_ERR_TIMEOUT;
+        goto DONE;
+    }
+
+    if ((err = sht71_read_result(*data, &result)) != SHT71_OK)
+        goto DONE;
+
+    if (*data == SHT71_CMD_MEASURE_T)
+    {
+        measure_values.temperature = result;
+
+        if ((err = sht71_start(SHT71_CMD_MEASURE_RH, now, &next_run)) != SHT71_OK)
+            goto DONE;
+
+        *data = SHT71_CMD_MEASURE_RH;
+
+        return next_run;
+    }
+
+    measure_values.humidity = result;
+
+DONE:
+    if (ready_pcmsk)
+        cbi(*ready_pcmsk, ready_bit);
+
+    callback = measure_callback;
+    measure_callback = 0;
+    measure_task = TASK_INVALID;
+
+    (*callback)(err, &measure_values);
+
+    return 0;
+}
+
+/*
+ * Start a temperature and humidity measurement.  The callback is called
+ * (from task_run_ready()) with the raw values once both are ready.
+ * Returns non-zero if a measurement is already in progress or the sensor
+ * didn't respond.
+ */
+uint8_t
+sht71_start_measurement(sht71_callback_t *callback)
+{
+    uint32_t    next_run;
+
+    if (measure_callback)
+        return 1;
+
+    if (sht71_start(SHT71_CMD_MEASURE_T, clock_current_time(), &next_run) != SHT71_OK)
+        return 1;
+
+    measure_callback = callback;
+
+    // the interrupt handler reads the handle, and may already be armed
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+    {
+        measure_task = task_submit(next_run, 0, sht71_measure_task, SHT71_CMD_MEASURE_T);
+    }
+
+    if (measure_task == TASK_INVALID)
+    {
+        if (ready_pcmsk)
+            cbi(*ready_pcmsk, ready_bit);
+
+        measure_callback = 0;
+        return 1;
+    }
+
+    // in case the interrupt came before there was a task to wake
+    if (data_ready)
+        task_wake(measure_task);
+
+    return 0;
+}
+#endif /* AVR_FEATURE_TASKS */
@@ -1,7 +1,19 @@
 /*
  * Implement a simple task scheduler
+ *
+ * Tasks live in a fixed table, and a binary min-heap of table indexes keeps
+ * them in order of next_run, so that submitting and cancelling a task take
+ * O(log n) and the next deadline is always at the top.  A task is known
+ * outside by a handle made of its table index and a generation count,
+ * which changes each time the slot is reused, so a stale handle can't
+ * cancel some other task.
+ *
+ * Interrupt handlers can't touch the heap, so task_wake() only flags the
+ * task; it is moved to the top of the heap the next time the main loop
+ * calls into the scheduler.
  */
 #include "avr-common.h"
+#include "clock.h"
 #include "task.h"
 
 #ifdef AVR_FEATURE_TASKS_MAX_SLOTS
@@ -9,31 +21,197 @@
 #else
 # define MAX_TASKS   4
 #endif
- 
+
+#if MAX_TASKS > 254
+# error "AVR_FEATURE_TASKS_MAX_SLOTS must be less than 255"
+#endif
+
 #define TF_NONE     0x00
 #define TF_VALID    0x01
+#define TF_RUNNING  0x02    /* taken off the heap while its callback runs */
 
 
 typedef struct queued_task  queued_task;
 struct queued_task
 {
     uint8_t             flags;
+    uint8_t             generation;
+    uint8_t             pos;        // index in the heap
     uint32_t            next_run;
     task_callback_t     *callback;
     uint16_t            retries;
     uint32_t            data;
 };
 
-static queued_task tasklist[MAX_TASKS];
+static queued_task  tasklist[MAX_TASKS];
+
+static uint8_t      heap[MAX_TASKS];
+static uint8_t      heap_len;
+
+static volatile uint8_t woken[MAX_TASKS];   // set by task_wake()
+static volatile uint8_t any_woken;
+
+#define TASK_HANDLE(I)      (((task_handle_t)tasklist[I].generation << 8) | (I))
+
+#define HEAP_BEFORE(A, B)   clock_time_before(tasklist[heap[A]].next_run, tasklist[heap[B]].next_run)
+
+static void
+task_heap_swap(uint8_t a, uint8_t b)
+{
+    uint8_t     t   = heap[a];
+
+    heap[a] = heap[b];
+    heap[b] = t;
+
+    tasklist[heap[a]].pos = a;
+    tasklist[heap[b]].pos = b;
+}
+
+static void
+task_heap_up(uint8_t pos)
+{
+    while (pos > 0)
+    {
+        uint8_t     parent  = (pos - 1) / 2;
+
+        if (!HEAP_BEFORE(pos, parent))
+            break;
+
+        task_heap_swap(pos, parent);
+        pos = parent;
+    }
+}
+
+static void
+task_heap_down(uint8_t pos)
+{
+    for (;;)
+    {
+        uint8_t     child   = 2 * pos + 1;
+
+        if (child >= heap_len)
+            break;
+
+        if (child + 1 < heap_len && HEAP_BEFORE(child + 1, child))
+            child++;
+
+        if (!HEAP_BEFORE(child, pos))
+            break;
+
+        task_heap_swap(pos, child);
+        pos = child;
+    }
+}
+
+static void
+task_heap_insert(uint8_t i)
+{
+    heap[heap_len] = i;
+    tasklist[i].pos = heap_len;
+    heap_len++;
+
+    task_heap_up(heap_len - 1);
+}
+
+static void
+task_heap_remove(uint8_t pos)
+{
+    uint8_t     moved;
+
+    heap_len--;
+
+    if (pos == heap_len)
+        return;
+
+    // move the last task into the gap, and then wherever it belongs
+    moved = heap[heap_len];
+    heap[pos] = moved;
+    tasklist[moved].pos = pos;
+
+    task_heap_up(pos);
+    task_heap_down(tasklist[moved].pos);
+}
+
+static void
+task_free(queued_task *t)
+{
+    t->flags = TF_NONE;
+    t->generation++;
+
+    woken[t - tasklist] = 0;
+}
+
+/*
+ * Make the tasks flagged by task_wake() due at next_run.  A task whose
+ * callback is running keeps its flag until it has been requeued.
+ */
+static void
+task_take_wakes(uint32_t next_run)
+{
+    if (!any_woken)
+        return;
+
+    any_woken = 0;
+
+    for (uint8_t i = 0; i < MAX_TASKS; i++)
+    {
+        queued_task *t  = &tasklist[i];
+
+        if (!woken[i])
+            continue;
+
+        if (t->flags & TF_RUNNING)
+        {
+            any_woken = 1;
+            continue;
+        }
+
+        woken[i] = 0;
+
+        if ((t->flags & TF_VALID) && clock_time_before(next_run, t->next_run))
+        {
+            t->next_run = next_run;
+            task_heap_up(t->pos);
+        }
+    }
+}
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+/*
+ * Have the clock interrupt when the next task is due
+ */
+static void
+task_set_wakeup(void)
+{
+    uint32_t    deadline;
+
+    if (task_next_deadline(&deadline) == 0)
+        clock_set_wakeup(deadline + 1);
+}
+#else
+#define task_set_wakeup()
+#endif
 
 void
 task_init(void)
 {
     for (uint8_t i = 0; i < MAX_TASKS; i++)
+    {
         tasklist[i].flags = TF_NONE;
+        woken[i] = 0;
+    }
+
+    heap_len = 0;
+    any_woken = 0;
 }
 
-void
+/*
+ * Queue a task to run on the first task_run_ready() after next_run.  It is
+ * run 'retries' times (or until the callback returns 0, if retries is 0).
+ * Returns a handle for task_cancel(), or TASK_INVALID if there is no free
+ * slot.
+ */
+task_handle_t
 task_submit(uint32_t next_run, uint16_t retries, task_callback_t *callback, uint32_t data)
 {
     for (uint8_t i = 0; i < MAX_TASKS; i++)
@@ -46,36 +224,147 @@ task_submit(uint32_t next_run, uint16_t retries, task_callback_t *callback, uint
             t->callback = callback;
             t->retries = retries;
             t->data = data;
-            t->flags |= TF_VALID;
-            break;
+            t->flags = TF_VALID;
+
+            task_heap_insert(i);
+            task_set_wakeup();
+
+            return TASK_HANDLE(i);
         }
     }
+
+    return TASK_INVALID;
+}
+
+/*
+ * Remove a task.  This may be called from a task's own callback, in which
+ * case its return value is ignored.  Returns 1 if the handle doesn't refer
+ * to a queued task (e.g. it has already finished).
+ */
+uint8_t
+task_cancel(task_handle_t handle)
+{
+    uint8_t     i   = handle & 0xff;
+    queued_task *t;
+
+    if (i >= MAX_TASKS)
+        return 1;
+
+    t = &tasklist[i];
+    if ((t->flags & TF_VALID) == 0 || t->generation != (uint8_t)(handle >> 8))
+        return 1;
+
+    if ((t->flags & TF_RUNNING) == 0)
+        task_heap_remove(t->pos);
+
+    task_free(t);
+
+    return 0;
+}
+
+/*
+ * Make a queued task due now, e.g. when the event it is waiting for has
+ * happened.  This is safe to call from an interrupt handler.  Returns 1 if
+ * the handle doesn't refer to a queued task.
+ */
+uint8_t
+task_wake(task_handle_t handle)
+{
+    uint8_t     i   = handle & 0xff;
+    queued_task *t;
+
+    if (i >= MAX_TASKS)
+        return 1;
+
+    t = &tasklist[i];
+    if ((t->flags & TF_VALID) == 0 || t->generation != (uint8_t)(handle >> 8))
+        return 1;
+
+    woken[i] = 1;
+    any_woken = 1;
+
+    return 0;
 }
 
 void
 task_run_ready(uint32_t now)
 {
-    for (uint8_t i = 0; i < MAX_TASKS; i++)
+    task_handle_t   ready[MAX_TASKS];
+    uint8_t         n_ready = 0;
+
+    task_take_wakes(now - 1);
+
+    /*
+     * Take the due tasks off the heap first, so that each runs once even
+     * if it asks to run again straight away
+     */
+    while (heap_len > 0 && clock_time_before(tasklist[heap[0]].next_run, now))
+    {
+        ready[n_ready++] = TASK_HANDLE(heap[0]);
+        tasklist[heap[0]].flags |= TF_RUNNING;
+
+        task_heap_remove(0);
+    }
+
+    for (uint8_t r = 0; r < n_ready; r++)
     {
+        uint8_t     i   = ready[r] & 0xff;
         queued_task *t  = &tasklist[i];
+        uint32_t    next;
+
+        /*
+         * An earlier callback may have cancelled this task, and even
+         * submitted a new one into its slot
+         */
+        if
+        (
+            (t->flags & (TF_VALID|TF_RUNNING)) != (TF_VALID|TF_RUNNING)
+            ||
+            t->generation != (uint8_t)(ready[r] >> 8)
+        )
+            continue;
+
+        next = (*t->callback)(t->next_run, &t->data);
 
-        if (t->flags & TF_VALID && t->next_run < now)
+        // cancelled by the callback, perhaps with a new task in its slot
+        if ((t->flags & TF_VALID) == 0 || t->generation != (uint8_t)(ready[r] >> 8))
+            continue;
+
+        t->flags &= ~TF_RUNNING;
+
+        if (t->retries != 1 && next != 0)
+        {
+            /* resubmit the task */
+            t->next_run = next;
+
+            if (t->retries != 0)
+                t->retries--;
+
+            task_heap_insert(i);
+        }
+        else
         {
-            uint32_t next = (*t->callback)(t->next_run, &t->data);
-
-            if (t->retries != 1 && next != 0)
-            {
-                /* resubmit the task */
-                t->next_run = next;
-
-                if (t->retries != 0)
-                    t->retries--;
-            }
-            else
-            {
-                /* delete this task */
-                t->flags = TF_NONE;
-            }
+            /* delete this task */
+            task_free(t);
         }
     }
+
+    task_set_wakeup();
+}
+
+/*
+ * Find when the next task is due (it runs on the first tick after
+ * next_run).  Returns 1 if there are no tasks.
+ */
+uint8_t
+task_next_deadline(uint32_t *deadline)
+{
+    task_take_wakes(clock_current_time() - 1);
+
+    if (heap_len == 0)
+        return 1;
+
+    *deadline = tasklist[heap[0]].next_run;
+
+    return 0;
 }
@@ -0,0 +1,211 @@
+/*
+ * Hierarchical timer wheel
+ *
+ * Pending timers are kept in lists in three wheels of 16 slots.  The first
+ * wheel has a slot per tick, the second a slot per 16 ticks and the third
+ * a slot per 256 ticks.  A timer goes in the finest wheel that reaches its
+ * expiry time (or the far end of the third wheel, if it is further away
+ * than that).  Each time a slot of a coarser wheel comes round, its timers
+ * are moved down into the finer wheels ("cascading").
+ *
+ * Starting and cancelling a timer take the same time however many timers
+ * there are, and each tick only looks at the timers that are due, so this
+ * suits protocol timeouts that are mostly cancelled before they expire.
+ * Timers are not interrupt safe: use them from the main loop only.
+ */
+#include "avr-common.h"
+#include "clock.h"
+#include "timer-wheel.h"
+
+#define WHEEL_BITS      4
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    3
+#define WHEEL_RANGE     (1UL << (WHEEL_BITS * WHEEL_LEVELS))
+
+static timer_wheel_entry_t  *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static uint32_t             wheel_time;         // the last tick processed
+static uint16_t             wheel_count;        // pending timers
+static uint8_t              wheel_running;      // in timer_wheel_run()
+
+/*
+ * Add a timer to the slot that comes round at (or just before) 'when',
+ * which mustn't be before wheel_time
+ */
+static void
+timer_wheel_insert(timer_wheel_entry_t *t, uint32_t when)
+{
+    uint32_t            delta   = when - wheel_time;
+    uint8_t             level   = 0;
+    timer_wheel_entry_t **slot;
+
+    // further away than the wheels reach: it'll be cascaded again later
+    if (delta >= WHEEL_RANGE)
+    {
+        delta = WHEEL_RANGE - 1;
+        when = wheel_time + delta;
+    }
+
+    while (delta >= WHEEL_SLOTS)
+    {
+        delta >>= WHEEL_BITS;
+        level++;
+    }
+
+    slot = &wheel[level][(when >> (level * WHEEL_BITS)) & WHEEL_MASK];
+
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+}
+
+static void
+timer_wheel_unlink(timer_wheel_entry_t *t)
+{
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+
+    t->pprev = 0;
+}
+
+/*
+ * Move the timers from the slot of a coarser wheel that has come round
+ */
+static void
+timer_wheel_cascade(uint8_t level)
+{
+    timer_wheel_entry_t **slot  = &wheel[level][(wheel_time >> (level * WHEEL_BITS)) & WHEEL_MASK];
+    timer_wheel_entry_t *t      = *slot;
+
+    *slot = 0;
+
+    while (t)
+    {
+        timer_wheel_entry_t *next   = t->next;
+
+        timer_wheel_insert(t, t->expires);
+        t = next;
+    }
+}
+
+/*
+ * Start (or restart) a timer, to call callback with data on the first
+ * timer_wheel_run() at or after tick 'expires'
+ */
+void
+timer_wheel_start(timer_wheel_entry_t *t, uint32_t expires, timer_wheel_callback_t *callback, uint32_t data)
+{
+    timer_wheel_cancel(t);
+
+    /*
+     * Nothing pending, so the wheels can jump straight to now; but not
+     * from a callback, as the timer would then miss the rest of the run
+     */
+    if (wheel_count == 0 && !wheel_running)
+        wheel_time = clock_current_time();
+
+    t->expires = expires;
+    t->callback = callback;
+    t->data = data;
+
+    timer_wheel_insert(t, clock_time_before(wheel_time, expires) ? expires : wheel_time + 1);
+    wheel_count++;
+
+#if AVR_FEATURE_CLOCK_TICKLESS
+    clock_set_wakeup(expires);
+#endif
+}
+
+void
+timer_wheel_cancel(timer_wheel_entry_t *t)
+{
+    if (t->pprev)
+    {
+        timer_wheel_unlink(t);
+        wheel_count--;
+    }
+}
+
+uint8_t
+timer_wheel_pending(const timer_wheel_entry_t *t)
+{
+    return t->pprev != 0;
+}
+
+/*
+ * Run the callbacks of the timers that have expired by 'now'.  This should
+ * be called from the main loop, as task_run_ready() is.
+ */
+void
+timer_wheel_run(uint32_t now)
+{
+    wheel_running = 1;
+
+    while (wheel_count && clock_time_before(wheel_time, now))
+    {
+        timer_wheel_entry_t **slot;
+
+        wheel_time++;
+
+        for (uint8_t level = WHEEL_LEVELS - 1; level > 0; level--)
+        {
+            if ((wheel_time & ((1UL << (level * WHEEL_BITS)) - 1)) == 0)
+                timer_wheel_cascade(level);
+        }
+
+        // callbacks may start timers, but not in this slot
+        slot = &wheel[0][wheel_time & WHEEL_MASK];
+        while (*slot)
+        {
+            timer_wheel_entry_t *t  = *slot;
+
+            timer_wheel_unlink(t);
+            wheel_count--;
+
+            (*t->callback)(wheel_time, t->data);
+        }
+    }
+
+    if (wheel_count == 0)
+        wheel_time = now;
+
+    wheel_running = 0;
+}
+
+/*
+ * Find the earliest tick at which a timer might expire (this can be early
+ * when the next timers are in the coarser wheels).  Returns 1 if there are
+ * no timers.
+ */
+uint8_t
+timer_wheel_next_deadline(uint32_t *deadline)
+{
+    uint8_t     found   = 0;
+
+    if (wheel_count == 0)
+        return 1;
+
+    for (uint8_t level = 0; level < WHEEL_LEVELS; level++)
+    {
+        uint8_t     shift   = level * WHEEL_BITS;
+
+        for (uint8_t i = 1; i <= WHEEL_SLOTS; i++)
+        {
+            uint32_t    t   = ((wheel_time >> shift) + i) << shift;
+
+            if (wheel[level][(t >> shift) & WHEEL_MASK])
+            {
+                if (!found || clock_time_before(t, *deadline))
+                    *deadline = t;
+
+                found = 1;
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
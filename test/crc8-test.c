@@ -0,0 +1,69 @@
+/*
+ * Host check of the CRC8 implementation selected by AVR_FEATURE_CRC8_TABLE
+ * (the Makefile builds one of these for each), against a plain bit-serial
+ * CRC, with a rough timing.  The timings only compare the variants with
+ * each other on the host; table lookups from flash cost the AVR more.
+ */
+#include <stdio.h>
+#include <time.h>
+
+#include "crc8.c"
+
+static uint8_t
+crc8_reference(uint8_t crc, uint8_t data)
+{
+    for (uint8_t i = 0; i < 8; i++)
+    {
+        uint8_t mix = (crc ^ data) & 0x01;
+
+        crc >>= 1;
+        if (mix)
+            crc ^= 0x8c;
+        data >>= 1;
+    }
+
+    return crc;
+}
+
+int
+main(void)
+{
+    static uint8_t  buf[4096];
+    int             failures    = 0;
+    struct timespec start;
+    struct timespec end;
+    uint8_t         crc         = 0;
+    double          ns;
+
+    for (uint16_t c = 0; c < 256; c++)
+    {
+        for (uint16_t d = 0; d < 256; d++)
+        {
+            if (crc8_update(c, d) != crc8_reference(c, d))
+                failures++;
+        }
+    }
+
+    // the example ROM ID from Maxim application note 27
+    if (crc8_rom(0xa200000001b81c02ULL) != 0)
+        failures++;
+
+    for (uint16_t i = 0; i < sizeof(buf); i++)
+        buf[i] = i * 37 + (i >> 8);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int rep = 0; rep < 2000; rep++)
+    {
+        buf[0] = crc;
+        for (uint16_t i = 0; i < sizeof(buf); i++)
+            crc = crc8_update(crc, buf[i]);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    ns = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / (2000.0 * sizeof(buf));
+
+    printf("crc8-test (table %3d): %.2f ns/byte, %s\n", AVR_FEATURE_CRC8_TABLE, ns,
+        failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}
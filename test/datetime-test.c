@@ -0,0 +1,210 @@
+/*
+ * Host check of the calendar conversions against gmtime(), for every day
+ * that a 32-bit Unix time can reach (1970-01-01 to 2106-02-07), and their
+ * speed in ns per call against the year-by-year loop they replaced.  The
+ * host times only give the ratio; the loop's 16-bit divisions cost far
+ * more on the AVR.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "datetime.c"
+
+static long failures;
+static long checked;
+
+static volatile uint32_t    sink;
+
+static void
+fail(uint32_t t, const char *what, const char *got, const char *expected)
+{
+    if (failures++ < 10)
+        printf("t=%lu: %s: got \"%s\", expected \"%s\"\n", (unsigned long)t, what, got, expected);
+}
+
+static void
+check(uint32_t t)
+{
+    time_t      tt  = t;
+    struct tm   *tm = gmtime(&tt);
+    datetime_t  dt;
+    char        got[DATETIME_HTTP_LEN];
+    char        expected[DATETIME_HTTP_LEN];
+
+    checked++;
+
+    datetime_from_unix(t, &dt);
+
+    if
+    (
+        dt.year != tm->tm_year + 1900
+        ||
+        dt.month != tm->tm_mon + 1
+        ||
+        dt.day != tm->tm_mday
+        ||
+        dt.hour != tm->tm_hour
+        ||
+        dt.min != tm->tm_min
+        ||
+        dt.sec != tm->tm_sec
+        ||
+        dt.wday != tm->tm_wday
+    )
+    {
+        datetime_format_iso(&dt, got);
+        strftime(expected, sizeof(expected), "%Y-%m-%dT%H:%M:%SZ", tm);
+        fail(t, "datetime_from_unix", got, expected);
+    }
+
+    datetime_format_http(&dt, got);
+    strftime(expected, sizeof(expected), "%a, %d %b %Y %H:%M:%S GMT", tm);
+    if (strlen(got) != DATETIME_HTTP_LEN - 1 || strcmp(got, expected) != 0)
+        fail(t, "datetime_format_http", got, expected);
+
+    datetime_format_iso(&dt, got);
+    strftime(expected, sizeof(expected), "%Y-%m-%dT%H:%M:%SZ", tm);
+    if (strlen(got) != DATETIME_ISO_LEN - 1 || strcmp(got, expected) != 0)
+        fail(t, "datetime_format_iso", got, expected);
+
+    if (datetime_to_unix(&dt) != t)
+        fail(t, "datetime_to_unix", "", "");
+}
+
+/*
+ * The conversion from rtc_set_time_from_ntp() before datetime.c, with its
+ * off-by-one fixed
+ */
+#define LEAP_YEAR(Y)        (((Y) % 4) == 0 && ( ((Y) % 100) != 0 || ((Y) % 400) == 0))
+#define DAYS_IN_YEAR(Y)     (LEAP_YEAR(Y) ? 366 : 365)
+#define DAYS_IN_MONTH(M, Y) \
+            ((M) == 2 ? (LEAP_YEAR(Y) ? 29 : 28) : \
+            (((M) == 4 || (M) == 6 || (M) == 9 || (M) == 11) ? 30 : \
+            31))
+
+static void
+loop_civil_from_days(uint32_t days, uint16_t *year, uint8_t *month, uint8_t *day)
+{
+    uint16_t    y   = 1970;
+    uint8_t     m   = 1;
+
+    while (days >= DAYS_IN_YEAR(y))
+    {
+        days -= DAYS_IN_YEAR(y);
+        y++;
+    }
+    while (days >= DAYS_IN_MONTH(m, y))
+    {
+        days -= DAYS_IN_MONTH(m, y);
+        m++;
+    }
+
+    *year = y;
+    *month = m;
+    *day = days + 1;
+}
+
+static double
+elapsed_ns(const struct timespec *start, long calls)
+{
+    struct timespec end;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec)) / calls;
+}
+
+/*
+ * Time each conversion over every day from 1970 to 2106, a few times over
+ */
+static void
+benchmark(void)
+{
+    uint32_t        days    = 0xffffffffUL / SECONDS_PER_DAY + 1;
+    long            calls   = 20 * days;
+    struct timespec start;
+    uint16_t        y;
+    uint8_t         m;
+    uint8_t         d;
+    datetime_t      dt;
+    char            buf[DATETIME_HTTP_LEN];
+
+    for (uint32_t day = 0; day < days; day++)
+    {
+        uint16_t    y2;
+        uint8_t     m2;
+        uint8_t     d2;
+
+        datetime_civil_from_days(day, &y, &m, &d);
+        loop_civil_from_days(day, &y2, &m2, &d2);
+        if (y != y2 || m != m2 || d != d2)
+            fail(day * SECONDS_PER_DAY, "loop_civil_from_days", "", "");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < calls; i++)
+    {
+        loop_civil_from_days(i % days, &y, &m, &d);
+        sink += y + m + d;
+    }
+    printf("datetime-test: year loop            %7.1f ns/call\n", elapsed_ns(&start, calls));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < calls; i++)
+    {
+        datetime_civil_from_days(i % days, &y, &m, &d);
+        sink += y + m + d;
+    }
+    printf("datetime-test: civil_from_days      %7.1f ns/call\n", elapsed_ns(&start, calls));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < calls; i++)
+    {
+        datetime_from_unix((uint32_t)i * 7919 * 1021, &dt);
+        sink += dt.day;
+    }
+    printf("datetime-test: datetime_from_unix   %7.1f ns/call\n", elapsed_ns(&start, calls));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < calls; i++)
+    {
+        dt.day = 1 + i % 28;
+        sink += datetime_to_unix(&dt);
+    }
+    printf("datetime-test: datetime_to_unix     %7.1f ns/call\n", elapsed_ns(&start, calls));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < calls; i++)
+    {
+        dt.sec = i % 60;
+        datetime_format_http(&dt, buf);
+        sink += buf[23];
+    }
+    printf("datetime-test: datetime_format_http %7.1f ns/call\n", elapsed_ns(&start, calls));
+}
+
+int
+main(void)
+{
+    uint32_t    last_day    = 0xffffffffUL / SECONDS_PER_DAY;
+
+    for (uint32_t day = 0; day <= last_day; day++)
+    {
+        uint32_t    base    = day * SECONDS_PER_DAY;
+
+        // midnight, the last second of the day, and one in between
+        check(base);
+        check(base + (day * 7919) % SECONDS_PER_DAY);
+        if (day < last_day)
+            check(base + SECONDS_PER_DAY - 1);
+    }
+
+    check(0xffffffffUL);
+
+    benchmark();
+
+    printf("datetime-test: %ld times, %s\n", checked, failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Host check of the history store: every sample left in the ring decodes
+ * to what was appended, as the ring wraps and evicts, including jumps
+ * between extreme values; the coarse tier holds the averages of the
+ * evicted samples; and a slowly changing series packs small.  Built with
+ * -fsanitize=undefined, to catch overflow in the delta arithmetic.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "history.c"
+
+static int  failures;
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            failures++; \
+        } \
+    } while (0)
+
+#define N_SAMPLES   50000
+#define RATIO       4
+
+static history_sample_t appended[N_SAMPLES];
+static history_sample_t averages[N_SAMPLES / RATIO];
+
+/*
+ * Check that h holds the last samples of the n in model
+ */
+static void
+check_history(const history_t *h, const history_sample_t *model, uint32_t n)
+{
+    history_iter_t      it;
+    history_sample_t    s;
+    uint32_t            i   = n - history_count(h);
+
+    CHECK(history_count(h) <= n);
+    CHECK(h->used <= h->size);
+
+    history_iter_init(&it, h);
+    while (history_iter_next(&it, &s))
+    {
+        CHECK(s.time == model[i].time);
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+            CHECK(s.value[c] == model[i].value[c]);
+
+        if (failures)
+            return;
+
+        i++;
+    }
+
+    CHECK(i == n);
+}
+
+/*
+ * The averages the coarse tier should have, from the first 'evicted'
+ * samples appended
+ */
+static uint32_t
+model_averages(uint32_t evicted)
+{
+    uint32_t    n   = evicted / RATIO;
+
+    for (uint32_t g = 0; g < n; g++)
+    {
+        averages[g].time = appended[g * RATIO].time;
+
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+        {
+            int32_t sum = 0;
+
+            for (uint8_t j = 0; j < RATIO; j++)
+                sum += appended[g * RATIO + j].value[c];
+
+            averages[g].value[c] = sum / RATIO;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * A random walk, sampled every 60s with the odd late sample, through a
+ * ring with a coarse tier behind it
+ */
+static void
+test_random_walk(void)
+{
+    static uint8_t  fine_buf[1024];
+    static uint8_t  coarse_buf[512];
+    history_t       fine;
+    history_t       coarse;
+    uint32_t        time    = 0xfffff000UL;
+    int32_t         values[HISTORY_CHANNELS]    = { 2150, -400 };
+
+    history_init(&coarse, coarse_buf, sizeof(coarse_buf), 0, 0);
+    history_init(&fine, fine_buf, sizeof(fine_buf), &coarse, RATIO);
+
+    for (uint32_t i = 0; i < N_SAMPLES; i++)
+    {
+        time += rand() % 20 ? 60 : 61 + rand() % 5;
+
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+        {
+            if (rand() % 3 == 0)
+                values[c] += rand() % 7 - 3;
+        }
+
+        history_append(&fine, time, values);
+
+        appended[i].time = time;
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+            appended[i].value[c] = values[c];
+
+        if (i % 97 == 0 || i == N_SAMPLES - 1)
+        {
+            check_history(&fine, appended, i + 1);
+            check_history(&coarse, averages, model_averages(i + 1 - history_count(&fine)));
+        }
+
+        if (failures)
+            return;
+    }
+
+    // both tiers have wrapped round their rings
+    CHECK(history_count(&fine) < N_SAMPLES / 10);
+    CHECK(history_count(&coarse) < model_averages(N_SAMPLES - history_count(&fine)));
+
+    printf("history-test: %.2f bytes per sample\n", (double)fine.used / history_count(&fine));
+    CHECK(fine.used < 2 * history_count(&fine));
+}
+
+/*
+ * Times and values jumping between the extremes, so that the differences
+ * overflow an int32_t
+ */
+static void
+test_extremes(void)
+{
+    static uint8_t  buf[256];
+    static const int32_t    extremes[]  = { INT32_MIN, INT32_MAX, 0, -1, 1, INT32_MIN + 1 };
+    history_t       h;
+    uint32_t        time    = 0;
+
+    history_init(&h, buf, sizeof(buf), 0, 0);
+
+    for (uint32_t i = 0; i < 5000; i++)
+    {
+        int32_t     values[HISTORY_CHANNELS];
+
+        time += rand() % 2 ? 0x80000000UL : (uint32_t)rand();
+
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+            values[c] = extremes[rand() % 6];
+
+        history_append(&h, time, values);
+
+        appended[i].time = time;
+        for (uint8_t c = 0; c < HISTORY_CHANNELS; c++)
+            appended[i].value[c] = values[c];
+
+        check_history(&h, appended, i + 1);
+
+        if (failures)
+            return;
+    }
+}
+
+int
+main(void)
+{
+    srand(1);
+
+    test_random_walk();
+    test_extremes();
+
+    printf("history-test: %s\n", failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}
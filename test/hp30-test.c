@@ -0,0 +1,223 @@
+/*
+ * Host check that hp30_compensate() gives the same results as the original
+ * formula with its library divisions, evaluated as the AVR does (16-bit
+ * int, wrapping 32-bit arithmetic; build with -fwrapv).  The one intended
+ * difference is d = 15, where the original's (1 << d) was -32768.  Also
+ * times both on the host, in ns per call; the AVR has no divider or
+ * barrel shifter, so hp30_benchmark_compensate() gives the cycles there.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "hp30.c"
+
+/*
+ * The I2C calls made by the rest of hp30.c
+ */
+void i2c_init(void) { }
+uint8_t i2c_start(uint8_t addr, uint8_t rw) { return 0; }
+uint8_t i2c_rep_start(uint8_t addr, uint8_t rw) { return 0; }
+uint8_t i2c_send_byte(uint8_t b) { return 0; }
+uint8_t i2c_read_byte_ack(void) { return 0; }
+uint8_t i2c_read_byte_nack(void) { return 0; }
+void i2c_stop(void) { }
+
+/*
+ * The compensation before the divisions were removed.  The casts give the
+ * AVR's 16-bit int promotions: c4 - 1024 and 1 << d are int, d1 - 7168 is
+ * unsigned int.
+ */
+static void
+hp30_compensate_orig(uint16_t d1, uint16_t d2, hp30_measure_t *values)
+{
+    int32_t     t1;
+    int32_t     dut;
+    int32_t     off;
+    int32_t     sens;
+    int32_t     x;
+    int16_t     d_pow2  = (int16_t)(1 << hp30_c.d);
+
+    t1 = ((int32_t)d2 - hp30_c.c5);
+    t1 = (t1 * t1) >> 14;
+
+    if ((int32_t)d2 >= hp30_c.c5)
+        dut = (int32_t)d2 - hp30_c.c5 - ((t1 * hp30_c.a) >> hp30_c.c);
+    else
+        dut = (int32_t)d2 - hp30_c.c5 - ((t1 * hp30_c.b) >> hp30_c.c);
+
+    off = (hp30_c.c2 + (((int16_t)(hp30_c.c4 - 1024) * dut) / 16384)) * 4;
+
+    sens = hp30_c.c1 + ((hp30_c.c3 * dut) / 1024);
+
+    x = ((sens * (uint16_t)(d1 - 7168)) / 16384) - off;
+
+    values->pressure = ((x * 10) / 32) + hp30_c.c7;
+
+    // d = 15 as the datasheet means it, not as a 16-bit int has it
+    values->temperature = 250 + ((dut * hp30_c.c6) / 65536)
+        - (hp30_c.d == 15 ? dut / 32768 : dut / d_pow2);
+}
+
+static void
+set_coefficients(void)
+{
+    hp30_c.c1 = rand();
+    hp30_c.c2 = rand();
+    hp30_c.c3 = rand();
+    hp30_c.c4 = rand();
+    hp30_c.c5 = rand();
+    hp30_c.c6 = rand();
+    hp30_c.c7 = rand();
+    hp30_c.a = rand() % 64;
+    hp30_c.b = rand() % 64;
+    hp30_c.c = rand() % 16;
+    hp30_c.d = rand() % 16;
+
+    hp30_derive();
+}
+
+static long     samples;
+static long     failures;
+
+static void
+check(uint16_t d1, uint16_t d2)
+{
+    hp30_measure_t  a;
+    hp30_measure_t  b;
+
+    hp30_compensate(d1, d2, &a);
+    hp30_compensate_orig(d1, d2, &b);
+
+    samples++;
+
+    if (a.pressure != b.pressure || a.temperature != b.temperature)
+    {
+        if (failures++ < 10)
+            printf("d1=%u d2=%u c5=%d d=%d: %ld/%ld, expected %ld/%ld\n",
+                d1, d2, hp30_c.c5, hp30_c.d,
+                (long)a.pressure, (long)a.temperature,
+                (long)b.pressure, (long)b.temperature);
+    }
+}
+
+/*
+ * hp30_shr() against the shift it replaces, for every count
+ */
+static void
+check_shr(void)
+{
+    static const int32_t    edges[] = { 0, 1, -1, 0xffff, 0x10000, -0x10000, INT32_MAX, INT32_MIN };
+
+    for (uint8_t k = 0; k < 16; k++)
+    {
+        hp30_c.c = k;
+        hp30_derive();
+
+        for (long i = 0; i < 200000; i++)
+        {
+            int32_t x   = i < 8 ? edges[i] : (int32_t)((uint32_t)rand() << 16 ^ rand());
+
+            samples++;
+
+            if (hp30_shr(x, hp30_k.c_mul) != x >> k)
+            {
+                if (failures++ < 10)
+                    printf("hp30_shr(%ld) for k=%d: %ld, expected %ld\n",
+                        (long)x, k, (long)hp30_shr(x, hp30_k.c_mul), (long)(x >> k));
+            }
+        }
+    }
+}
+
+static volatile uint32_t    sink;
+
+static double
+time_compensate(void (*compensate)(uint16_t, uint16_t, hp30_measure_t *))
+{
+    struct timespec start;
+    struct timespec end;
+    hp30_measure_t  values;
+    long            calls   = 10000000;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < calls; i++)
+    {
+        (*compensate)(i * 251, hp30_c.c5 + (i & 0x1fff) - 4096, &values);
+        sink += values.pressure;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    return ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / calls;
+}
+
+int
+main(void)
+{
+    srand(1);
+
+    check_shr();
+
+    // a realistic calibration (HP03 datasheet example)
+    hp30_c.c1 = 29908;
+    hp30_c.c2 = 3724;
+    hp30_c.c3 = 312;
+    hp30_c.c4 = 441;
+    hp30_c.c5 = 9191;
+    hp30_c.c6 = 3990;
+    hp30_c.c7 = 2500;
+    hp30_c.a = 1;
+    hp30_c.b = 4;
+    hp30_c.c = 4;
+
+    for (uint8_t d = 1; d < 16; d++)
+    {
+        hp30_c.d = d;
+        hp30_derive();
+
+        // every temperature reading, with a spread of pressure readings
+        for (uint32_t d2 = 0; d2 < 0x10000; d2++)
+            check(d2 * 40503 + d, d2);
+    }
+
+    // random calibrations, with the boundary readings
+    for (int set = 0; set < 2000; set++)
+    {
+        static const uint16_t   edges[] = { 0, 1, 7167, 7168, 7169, 0x7fff, 0x8000, 0xffff };
+
+        set_coefficients();
+
+        for (uint8_t i = 0; i < sizeof(edges) / sizeof(edges[0]); i++)
+        {
+            for (uint8_t j = 0; j < sizeof(edges) / sizeof(edges[0]); j++)
+                check(edges[i], edges[j]);
+
+            check(edges[i], hp30_c.c5);
+            check(edges[i], hp30_c.c5 - 1);
+        }
+
+        for (int i = 0; i < 20000; i++)
+            check(rand(), rand());
+    }
+
+    // time the realistic calibration
+    hp30_c.c1 = 29908;
+    hp30_c.c2 = 3724;
+    hp30_c.c3 = 312;
+    hp30_c.c4 = 441;
+    hp30_c.c5 = 9191;
+    hp30_c.c6 = 3990;
+    hp30_c.c7 = 2500;
+    hp30_c.a = 1;
+    hp30_c.b = 4;
+    hp30_c.c = 4;
+    hp30_c.d = 9;
+    hp30_derive();
+
+    printf("hp30-test: original %.1f ns/call, hp30_compensate %.1f ns/call\n",
+        time_compensate(hp30_compensate_orig), time_compensate(hp30_compensate));
+
+    printf("hp30-test: %ld samples, %s\n", samples, failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Host check of the sampler's accounting: a conversion that takes more
+ * than a period is abandoned and counted as failed, and its late results
+ * are ignored rather than taken for the next conversion's; and a driver
+ * that fails within start() is counted once, as failed.
+ */
+#include <stdio.h>
+
+#include "sampler.c"
+
+static uint32_t current_time;
+
+uint32_t
+clock_current_time(void)
+{
+    return current_time;
+}
+
+task_handle_t
+task_submit(uint32_t next_run, uint16_t retries, task_callback_t *callback, uint32_t data)
+{
+    return 0;
+}
+
+uint8_t
+task_cancel(task_handle_t handle)
+{
+    return 0;
+}
+
+static int  failures;
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            failures++; \
+        } \
+    } while (0)
+
+#define PERIOD  10
+
+static sampler_tag_t    last_tag;
+static uint8_t          start_result;
+static uint8_t          fail_within_start;
+
+static uint8_t
+test_start(sampler_tag_t tag)
+{
+    last_tag = tag;
+
+    if (fail_within_start)
+        sampler_complete(tag, 1);
+
+    return start_result;
+}
+
+/*
+ * Run the sampler task at the sensor's next due time
+ */
+static void
+run_period(uint8_t sensor)
+{
+    current_time = sensors[sensor].due;
+    sampler_task(current_time, 0);
+}
+
+/*
+ * A slow conversion, abandoned a period after it started, completes just
+ * after the next one has started
+ */
+static void
+test_abandoned(void)
+{
+    sampler_stats_t     st  = { 0 };
+    sampler_sample_t    sample;
+    sampler_tag_t       slow_tag;
+    uint8_t             sensor  = sampler_add_sensor(PERIOD, test_start);
+
+    run_period(sensor);
+    slow_tag = last_tag;
+
+    run_period(sensor);     // still busy: abandoned
+    sampler_get_stats(sensor, &st);
+    CHECK(st.started == 1 && st.missed == 1 && st.failed == 1);
+
+    run_period(sensor);     // the next conversion
+    CHECK(last_tag != slow_tag);
+    CHECK(sampler_tag_sensor(last_tag) == sensor);
+
+    current_time += 2;
+    sampler_record(slow_tag, 0, -1);
+    sampler_complete(slow_tag, 0);
+
+    sampler_get_stats(sensor, &st);
+    CHECK(st.started == 2 && st.completed == 0 && st.failed == 1);
+    CHECK(sampler_read(&sample) == 0);
+    CHECK(sampler_age(sensor) == 0xffffffff);
+
+    current_time += 3;
+    sampler_record(last_tag, 0, 42);
+    sampler_complete(last_tag, 0);
+
+    sampler_get_stats(sensor, &st);
+    CHECK(st.started == 2 && st.completed == 1 && st.failed == 1);
+    CHECK(st.last_latency == 5);
+    CHECK(sampler_read(&sample) == 1 && sample.sensor == sensor && sample.value == 42);
+    CHECK(sampler_age(sensor) == 0);
+
+    // a repeated completion is ignored too
+    sampler_complete(last_tag, 1);
+    sampler_get_stats(sensor, &st);
+    CHECK(st.completed == 1 && st.failed == 1);
+}
+
+/*
+ * A driver that fails, calling back within start() or not
+ */
+static void
+test_start_failure(void)
+{
+    sampler_stats_t     st  = { 0 };
+    uint8_t             sensor  = sampler_add_sensor(PERIOD, test_start);
+
+    start_result = 1;
+    fail_within_start = 1;
+    run_period(sensor);
+
+    sampler_get_stats(sensor, &st);
+    CHECK(st.started == 1 && st.failed == 1 && st.missed == 0);
+    CHECK((sensors[sensor].flags & SF_BUSY) == 0);
+
+    fail_within_start = 0;
+    run_period(sensor);
+
+    sampler_get_stats(sensor, &st);
+    CHECK(st.started == 1 && st.failed == 1 && st.missed == 1);
+    CHECK((sensors[sensor].flags & SF_BUSY) == 0);
+
+    // nor is a late callback from a conversion that didn't start counted
+    sampler_complete(last_tag, 1);
+    sampler_get_stats(sensor, &st);
+    CHECK(st.failed == 1);
+
+    start_result = 0;
+}
+
+int
+main(void)
+{
+    current_time = 1000;
+
+    test_abandoned();
+    test_start_failure();
+
+    printf("sampler-test: %s\n", failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}
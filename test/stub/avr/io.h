@@ -0,0 +1,10 @@
+/*
+ * Host stand-in for <avr/io.h>: the modules under test don't touch any
+ * registers
+ */
+#ifndef __STUB_AVR_IO_H
+#define __STUB_AVR_IO_H
+
+#include <stdint.h>
+
+#endif /* __STUB_AVR_IO_H */
@@ -0,0 +1,14 @@
+/*
+ * Host stand-in for <avr/pgmspace.h>: flash is ordinary memory
+ */
+#ifndef __STUB_AVR_PGMSPACE_H
+#define __STUB_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define PSTR(S)             (S)
+#define pgm_read_byte(P)    (*(const uint8_t *)(P))
+#define pgm_read_word(P)    (*(const uint16_t *)(P))
+
+#endif /* __STUB_AVR_PGMSPACE_H */
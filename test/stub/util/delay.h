@@ -0,0 +1,10 @@
+/*
+ * Host stand-in for <util/delay.h>
+ */
+#ifndef __STUB_UTIL_DELAY_H
+#define __STUB_UTIL_DELAY_H
+
+#define _delay_ms(MS)
+#define _delay_us(US)
+
+#endif /* __STUB_UTIL_DELAY_H */
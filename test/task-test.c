@@ -0,0 +1,316 @@
+/*
+ * Host check of the task scheduler: cancelling tasks from callbacks, waking
+ * tasks early, and the heap against random submit/cancel/resubmit sequences
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#define AVR_FEATURE_TASKS_MAX_SLOTS 8
+
+#include "task.c"
+
+static uint32_t current_time;
+
+uint32_t
+clock_current_time(void)
+{
+    return current_time;
+}
+
+static int  failures;
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            failures++; \
+        } \
+    } while (0)
+
+/*
+ * Cancelling a task from another task's callback in the same batch
+ */
+static task_handle_t    victim;
+static int              victim_runs;
+static int              reuse_runs;
+
+static uint32_t
+victim_task(uint32_t now, uint32_t *data)
+{
+    victim_runs++;
+
+    return 0;
+}
+
+static uint32_t
+reuse_task(uint32_t now, uint32_t *data)
+{
+    reuse_runs++;
+
+    return 0;
+}
+
+static uint32_t
+killer_task(uint32_t now, uint32_t *data)
+{
+    CHECK(task_cancel(victim) == 0);
+
+    // reuse the victim's slot, for later
+    if (*data)
+        CHECK(task_submit(1000, 1, reuse_task, 0) != TASK_INVALID);
+
+    return 0;
+}
+
+static void
+test_cancel_from_callback(uint32_t reuse)
+{
+    task_init();
+    victim_runs = reuse_runs = 0;
+
+    // same deadline, so the killer (submitted first) runs first
+    CHECK(task_submit(5, 1, killer_task, reuse) != TASK_INVALID);
+    victim = task_submit(5, 1, victim_task, 0);
+    CHECK(victim != TASK_INVALID);
+
+    task_run_ready(10);
+
+    CHECK(victim_runs == 0);
+    CHECK(reuse_runs == 0);
+    CHECK(task_cancel(victim) == 1);
+    CHECK(heap_len == (reuse ? 1 : 0));
+
+    if (reuse)
+    {
+        uint32_t    deadline;
+
+        CHECK(task_next_deadline(&deadline) == 0 && deadline == 1000);
+
+        task_run_ready(1001);
+        CHECK(reuse_runs == 1);
+        CHECK(heap_len == 0);
+    }
+}
+
+/*
+ * A task cancelling itself: its return value is ignored
+ */
+static task_handle_t    self;
+
+static uint32_t
+self_cancel_task(uint32_t now, uint32_t *data)
+{
+    CHECK(task_cancel(self) == 0);
+
+    return now + 1;
+}
+
+static void
+test_self_cancel(void)
+{
+    task_init();
+
+    self = task_submit(0, 0, self_cancel_task, 0);
+    task_run_ready(1);
+
+    CHECK(heap_len == 0);
+    CHECK((tasklist[self & 0xff].flags & TF_VALID) == 0);
+}
+
+/*
+ * A task cancelling itself and submitting its replacement, which takes
+ * the same slot: the old callback's return value mustn't touch the new
+ * task
+ */
+static int  replaced_runs;
+
+static uint32_t
+replaced_task(uint32_t now, uint32_t *data)
+{
+    replaced_runs++;
+
+    return 0;
+}
+
+static uint32_t
+replace_self_task(uint32_t now, uint32_t *data)
+{
+    task_handle_t   h;
+
+    CHECK(task_cancel(self) == 0);
+
+    h = task_submit(now + 10, 1, replaced_task, 0);
+    CHECK(h != TASK_INVALID && (h & 0xff) == (self & 0xff) && h != self);
+
+    return *data ? now + 1 : 0;
+}
+
+static void
+test_replace_self(uint32_t keep)
+{
+    uint32_t    deadline;
+
+    task_init();
+    replaced_runs = 0;
+
+    self = task_submit(0, 0, replace_self_task, keep);
+    task_run_ready(1);
+
+    CHECK(heap_len == 1);
+    CHECK(task_next_deadline(&deadline) == 0 && deadline == 10);
+
+    task_run_ready(2);
+    CHECK(replaced_runs == 0);
+
+    task_run_ready(11);
+    CHECK(replaced_runs == 1);
+    CHECK(heap_len == 0);
+}
+
+/*
+ * task_wake() makes a task due straight away, once
+ */
+static int  wake_runs;
+
+static uint32_t
+wake_task(uint32_t now, uint32_t *data)
+{
+    wake_runs++;
+
+    // a wake while running takes effect once the task is requeued
+    if (*data)
+    {
+        *data = 0;
+        CHECK(task_wake(self) == 0);
+    }
+
+    return now + 1000;
+}
+
+static void
+test_wake(void)
+{
+    uint32_t    deadline;
+
+    task_init();
+    wake_runs = 0;
+    current_time = 100;
+
+    self = task_submit(1000, 0, wake_task, 0);
+    CHECK(task_wake(self) == 0);
+
+    // seen by task_next_deadline() too, for the run loop
+    CHECK(task_next_deadline(&deadline) == 0 && clock_time_before(deadline, current_time));
+
+    task_run_ready(current_time);
+    CHECK(wake_runs == 1);
+    CHECK(task_next_deadline(&deadline) == 0 && deadline == 99 + 1000);
+
+    task_run_ready(current_time + 1);
+    CHECK(wake_runs == 1);
+
+    // woken from within its own callback
+    tasklist[self & 0xff].data = 1;
+    CHECK(task_wake(self) == 0);
+    task_run_ready(current_time + 2);
+    CHECK(wake_runs == 2);
+    task_run_ready(current_time + 3);
+    CHECK(wake_runs == 3);
+
+    // stale handles
+    CHECK(task_cancel(self) == 0);
+    CHECK(task_wake(self) == 1);
+    CHECK(task_wake(TASK_INVALID) == 1);
+}
+
+/*
+ * Random submits, cancels and resubmits across the tick counter wrapping;
+ * every task must run exactly when it is due
+ */
+static uint32_t     due[256];
+static int          late;
+
+static uint32_t
+random_task(uint32_t now, uint32_t *data)
+{
+    if (now != due[*data & 0xff])
+        late++;
+
+    if (rand() % 4 == 0)
+        return 0;
+
+    due[*data & 0xff] = now + 1 + rand() % 20;
+
+    return due[*data & 0xff];
+}
+
+static void
+test_random(void)
+{
+    task_handle_t   handles[16];
+    uint8_t         n_handles   = 0;
+    uint32_t        now         = 0xfffff000UL;
+    uint32_t        id          = 0;
+
+    task_init();
+    srand(1);
+    late = 0;
+
+    for (long step = 0; step < 200000; step++)
+    {
+        now++;
+
+        if (rand() % 3 == 0)
+        {
+            task_handle_t   h;
+
+            due[id & 0xff] = now + rand() % 30;
+            h = task_submit(due[id & 0xff], rand() % 4, random_task, id & 0xff);
+            if (h != TASK_INVALID)
+                handles[n_handles++ % 16] = h;
+            id++;
+        }
+
+        if (rand() % 7 == 0 && n_handles)
+            task_cancel(handles[rand() % (n_handles < 16 ? n_handles : 16)]);
+
+        task_run_ready(now);
+
+        uint8_t     valid   = 0;
+
+        for (uint8_t i = 0; i < MAX_TASKS; i++)
+            if (tasklist[i].flags & TF_VALID)
+                valid++;
+
+        CHECK(valid == heap_len);
+
+        for (uint8_t i = 0; i < heap_len; i++)
+        {
+            CHECK(tasklist[heap[i]].pos == i);
+            CHECK(i == 0 || !HEAP_BEFORE(i, (i - 1) / 2));
+            CHECK(!clock_time_before(tasklist[heap[i]].next_run, now));
+        }
+
+        if (failures)
+            break;
+    }
+
+    CHECK(late == 0);
+}
+
+int
+main(void)
+{
+    test_cancel_from_callback(0);
+    test_cancel_from_callback(1);
+    test_self_cancel();
+    test_replace_self(0);
+    test_replace_self(1);
+    test_wake();
+    test_random();
+
+    printf("task-test: %s\n", failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}
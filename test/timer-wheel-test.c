@@ -0,0 +1,222 @@
+/*
+ * Host check of the timer wheel against a naive model: random starts,
+ * cancels and restarts (some from callbacks) of 3000 timers, with
+ * timeouts out past the range of the wheels, runs that are late by up to
+ * 50 ticks, and the tick counter wrapping.  Every timer must fire exactly
+ * once, in the tick it is due.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "timer-wheel.c"
+
+static uint32_t current_time;
+
+uint32_t
+clock_current_time(void)
+{
+    return current_time;
+}
+
+static int  failures;
+
+#define CHECK(COND) \
+    do { \
+        if (!(COND)) \
+        { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            failures++; \
+        } \
+    } while (0)
+
+#define N_TIMERS    3000
+
+static timer_wheel_entry_t  timers[N_TIMERS];
+static uint8_t              pending[N_TIMERS];
+static uint32_t             due[N_TIMERS];      // the tick it should fire in
+static uint32_t             run_now;            // now of the current run
+static uint32_t             wheel_now;          // the tick being run, or now
+static long                 fired;
+
+static void     test_callback(uint32_t now, uint32_t data);
+
+/*
+ * Start a timer in the model and the wheel.  The wheel has been run up
+ * to current_time (or, in a callback, the tick being run), so a timer
+ * that is already due fires in the next tick.
+ */
+static void
+test_start(uint16_t i, uint32_t expires)
+{
+    due[i] = clock_time_before(wheel_now, expires) ? expires : wheel_now + 1;
+    pending[i] = 1;
+
+    timer_wheel_start(&timers[i], expires, test_callback, i);
+}
+
+static uint32_t
+test_timeout(void)
+{
+    switch (rand() % 8)
+    {
+    case 0:
+        return rand() % 20000;      // past the third wheel
+
+    case 1:
+    case 2:
+        return rand() % 4096;
+
+    default:
+        return rand() % 256;
+    }
+}
+
+static void
+test_callback(uint32_t now, uint32_t data)
+{
+    uint16_t    i   = data;
+
+    fired++;
+    wheel_now = now;
+
+    CHECK(pending[i]);
+    CHECK(now == due[i]);
+    CHECK(!clock_time_before(run_now, now));
+    CHECK(!timer_wheel_pending(&timers[i]));
+
+    pending[i] = 0;
+
+    // restart this timer, or start or cancel another, from the callback
+    switch (rand() % 8)
+    {
+    case 0:
+        test_start(i, current_time - 10 + test_timeout());
+        break;
+
+    case 1:
+        test_start(rand() % N_TIMERS, current_time + test_timeout());
+        break;
+
+    case 2:
+        i = rand() % N_TIMERS;
+        timer_wheel_cancel(&timers[i]);
+        pending[i] = 0;
+        break;
+    }
+}
+
+/*
+ * The only timer, restarted from its callback in a late run, for a tick
+ * that the run hasn't reached yet: it must fire in the same run
+ */
+static timer_wheel_entry_t  single;
+static uint32_t             single_fired[2];
+static uint8_t              single_runs;
+
+static void
+single_callback(uint32_t now, uint32_t data)
+{
+    single_fired[single_runs++] = now;
+
+    if (data)
+        timer_wheel_start(&single, now + 3, single_callback, 0);
+}
+
+static void
+test_restart_late(void)
+{
+    current_time = 100;
+    timer_wheel_start(&single, 105, single_callback, 1);
+
+    current_time = 120;
+    timer_wheel_run(current_time);
+
+    CHECK(single_runs == 2);
+    CHECK(single_fired[0] == 105 && single_fired[1] == 108);
+    CHECK(!timer_wheel_pending(&single));
+}
+
+static void
+test_random(void)
+{
+    uint32_t    start   = 0xfff00000UL;
+    uint8_t     wraps   = 0;
+
+    current_time = start;
+
+    for (long step = 0; step < 400000; step++)
+    {
+        uint32_t    deadline;
+        uint32_t    earliest    = 0;
+        uint16_t    n_pending   = 0;
+
+        // mostly one tick at a time, sometimes a late run
+        current_time += rand() % 10 ? 1 : 1 + rand() % 50;
+        if (current_time < start)
+            wraps = 1;
+
+        run_now = current_time;
+        timer_wheel_run(current_time);
+        wheel_now = current_time;
+
+        for (uint8_t n = rand() % 4; n > 0; n--)
+        {
+            uint16_t    i   = rand() % N_TIMERS;
+
+            if (rand() % 3)
+            {
+                test_start(i, current_time + test_timeout());
+            }
+            else
+            {
+                timer_wheel_cancel(&timers[i]);
+                pending[i] = 0;
+            }
+        }
+
+        for (uint16_t i = 0; i < N_TIMERS; i++)
+        {
+            CHECK(pending[i] == timer_wheel_pending(&timers[i]));
+
+            if (!pending[i])
+                continue;
+
+            // nothing left behind that was due
+            CHECK(clock_time_before(current_time, due[i]));
+
+            if (n_pending++ == 0 || clock_time_before(due[i], earliest))
+                earliest = due[i];
+        }
+
+        CHECK(n_pending == wheel_count);
+
+        // the deadline may be early, but never late
+        if (n_pending)
+        {
+            CHECK(timer_wheel_next_deadline(&deadline) == 0);
+            CHECK(!clock_time_before(earliest, deadline));
+            CHECK(clock_time_before(current_time, deadline));
+        }
+        else
+        {
+            CHECK(timer_wheel_next_deadline(&deadline) == 1);
+        }
+
+        if (failures)
+            break;
+    }
+
+    CHECK(wraps);
+    CHECK(fired > 100000);
+}
+
+int
+main(void)
+{
+    test_restart_late();
+    test_random();
+
+    printf("timer-wheel-test: %ld timers fired, %s\n", fired, failures ? "FAILED" : "ok");
+
+    return failures != 0;
+}